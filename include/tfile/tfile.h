@@ -1,16 +1,45 @@
 #pragma once
 
+#include <errno.h>
+#include <math.h>
 #include <stddef.h>
+#include <dirent.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <streambuf>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #ifdef __cpp_exceptions
+#include <exception>
 #include <stdexcept>
 #endif
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace tfile {
 
 /** Return the size in bytes of a file. */
@@ -22,8 +51,21 @@ void read(const char* filename, std::string&);
 /** Read an entire file in and return it as a strings. */
 std::string read(const char* filename);
 
+/** Return the offset of the first byte in data that is not part of valid
+    UTF-8, or std::string::npos if it is all valid */
+size_t validateUtf8(const char* data, size_t length);
+
+/** Read an entire file into a string, validating it as UTF-8 block by
+    block as it comes in.  Returns the offset of the first invalid byte, or
+    std::string::npos if the file is valid UTF-8. */
+size_t readUtf8(const char* filename, std::string&);
+
 using Lines = std::vector<std::string>;
 
+/** Read `length` bytes of a file starting at `offset`, or fewer at EOF */
+std::string read(const char* filename, size_t offset, size_t length);
+void read(const char* filename, size_t offset, size_t length, std::string&);
+
 /** Read a file into a vector of strings with the platform's line-endings */
 Lines readLines(const char* filename);
 void readLines(const char* filename, Lines&);
@@ -41,6 +83,25 @@ size_t writeLines(const char* filename, Container);
 template <typename ForwardIt>
 size_t writeLines(const char* filename, ForwardIt begin, ForwardIt end);
 
+/** Write an entire file to a temporary file and rename it into place, so
+    readers see either the old contents or the new, never a partial file */
+size_t writeAtomic(const char* filename, const char* data, size_t length);
+size_t writeAtomic(const char* filename, const std::string& s);
+
+enum class WriteResult {unchanged, created, changed, failed};
+
+/** Write an entire file only if its contents would change.
+
+    The existing file is compared first by size and then block by block, and
+    is left untouched - contents, mtime and inode - if it is identical.
+    Otherwise the new contents are written with writeAtomic.  If the file
+    exists but can't be read, or can't be written, it throws if exceptions
+    are enabled and returns WriteResult::failed if they aren't.
+ */
+WriteResult writeIfDifferent(
+    const char* filename, const char* data, size_t length);
+WriteResult writeIfDifferent(const char* filename, const std::string& s);
+
 /*
 File Openers
 ===============
@@ -112,6 +173,8 @@ const char* modeString(Mode);
 template <Mode>
 class Opener;
 
+class Directory;
+
 using Reader = Opener<Mode::read>;
 using ReaderWriter = Opener<Mode::readWrite>;
 using Writer = Opener<Mode::write>;
@@ -146,6 +209,26 @@ enum class Newline {
 
 template <Newline = Newline::system>
 const char* newlineString();
+const char* newlineString(Newline);
+
+/** Guess the Newline used in a file from its first block: one of lf,
+    cr_lf or cr, or system if it has no newlines */
+Newline detectNewline(const char* filename);
+
+/** Copy a file, replacing each `from` newline with a `to` newline, a block
+    at a time.  Returns the number of bytes written.  If writing fails, it
+    throws if exceptions are enabled, and returns 0 if they aren't. */
+size_t convertNewlines(const char* in, const char* out, Newline from,
+                       Newline to);
+
+/** Like the above, detecting the input's Newline with detectNewline */
+size_t convertNewlines(const char* in, const char* out, Newline to);
+
+/** Convert a file in place, which requires that the `to` newline is no
+    longer than `from`.  Returns the new size of the file.  If a write
+    fails, the file is not truncated, so no input is lost, and the error is
+    reported as above. */
+size_t convertNewlines(const char* filename, Newline from, Newline to);
 
 /** Wraps a file, with mixins for reading or writing */
 template <template <typename> class ... Mixins>
@@ -191,6 +274,17 @@ class FileHandle : public Mixins<FileHandle<Mixins...>>... {
 template <Newline NL, typename Reader> class LineReader;
 template <Newline NL, typename Writer> class LineWriter;
 
+/** Identifies a file independent of its name */
+struct FileId {
+    dev_t device;
+    ino_t inode;
+
+    bool operator==(const FileId& o) const {
+        return device == o.device and inode == o.inode;
+    }
+    bool operator!=(const FileId& o) const { return not (*this == o); }
+};
+
 /** Base for all Readers */
 template <typename Derived>
 class ReaderBase {
@@ -199,6 +293,21 @@ class ReaderBase {
     size_t read(std::string& s);
     std::string read(size_t size);
 
+    /** Append bytes to `s` up to and including the next `delimiter`, or to
+        the end of the file, but no more than `maxLength` bytes.  Return the
+        number of bytes appended. */
+    size_t readUntil(std::string& s, char delimiter,
+                     size_t maxLength = std::string::npos);
+
+    /** Return the current position in the file */
+    off_t tell();
+
+    /** Seek, like FileHandle::seek, for code that only has a ReaderBase */
+    int seek(off_t offset, int whence = SEEK_SET);
+
+    /** Return the identity of the file */
+    FileId fileId();
+
     /** Return a LineReader */
     template <Newline NL = Newline::system>
     LineReader<NL, ReaderBase> lines();
@@ -206,6 +315,11 @@ class ReaderBase {
     /** Return a LineReader - for use in ReaderWriters */
     template <Newline NL = Newline::system>
     LineReader<NL, ReaderBase> readLines();
+
+    /** Return a LineReader over the lines that start in [begin, end): see
+        LineReader::range */
+    template <Newline NL = Newline::system>
+    LineReader<NL, ReaderBase> lines(size_t begin, size_t end);
 };
 
 /** Base for all Writerse */
@@ -216,6 +330,12 @@ class WriterBase {
     size_t write(const char* data);
     size_t write(const std::string&);
 
+    /** Reserve disk space for `length` more bytes past the current position
+        so a large file is laid out in few extents.  The file size doesn't
+        change.  Returns 0, or an errno value if the space could not be
+        reserved, which is harmless. */
+    int preallocate(size_t length);
+
     /** Return a LineWriter */
     template <Newline NL = Newline::system>
     LineWriter<NL, WriterBase> lines();
@@ -225,11 +345,182 @@ class WriterBase {
     LineWriter<NL, WriterBase> writeLines();
 };
 
+template <typename Source, typename Predicate> class Filter;
+template <typename Source, typename Function> class Map;
+template <typename Source> class Take;
+
+/**
+   Lazy stages that chain onto a source of lines, like
+
+       reader.lines().filter(isData).map(parse).take(10).forEach(use);
+
+   Nothing is read until forEach is called, and then the whole chain runs as
+   one loop, with no intermediate containers, which stops reading as soon as
+   `take` is satisfied.
+
+   A Derived source provides `template <typename Sink> void run(Sink&)`,
+   which calls `sink(item)` for each item until it returns false.
+
+   A stage built on a named source refers to it rather than copying it, so
+   after the pipeline runs, a LineReader's offset(), lineNumber() and
+   checkpoint() are just past the last line the pipeline read.  A stage
+   built on a temporary takes it over.
+*/
+template <typename Derived>
+class Pipeline {
+  public:
+    /** Only pass on items for which `predicate(item)` is true */
+    template <typename Predicate>
+    Filter<Derived&, Predicate> filter(Predicate predicate) &;
+    template <typename Predicate>
+    Filter<Derived, Predicate> filter(Predicate predicate) &&;
+
+    /** Pass on `function(item)` instead of each item */
+    template <typename Function>
+    Map<Derived&, Function> map(Function function) &;
+    template <typename Function>
+    Map<Derived, Function> map(Function function) &&;
+
+    /** Pass on at most `count` items, then stop reading */
+    Take<Derived&> take(size_t count) &;
+    Take<Derived> take(size_t count) &&;
+
+    /** Run the pipeline, applying a function to each item */
+    template <typename Function>
+    void forEach(Function);
+};
+
+template <typename Source, typename Predicate>
+class Filter : public Pipeline<Filter<Source, Predicate>> {
+  public:
+    Filter(Source source, Predicate p)
+            : source_(std::forward<Source>(source)), predicate_(p) {}
+
+    template <typename Sink>
+    void run(Sink&);
+
+  private:
+    Source source_;
+    Predicate predicate_;
+};
+
+template <typename Source, typename Function>
+class Map : public Pipeline<Map<Source, Function>> {
+  public:
+    Map(Source source, Function f)
+            : source_(std::forward<Source>(source)), function_(f) {}
+
+    template <typename Sink>
+    void run(Sink&);
+
+  private:
+    Source source_;
+    Function function_;
+};
+
+template <typename Source>
+class Take : public Pipeline<Take<Source>> {
+  public:
+    Take(Source source, size_t count)
+            : source_(std::forward<Source>(source)), count_(count) {}
+
+    template <typename Sink>
+    void run(Sink&);
+
+  private:
+    Source source_;
+    size_t count_;
+};
+
+/** What a LineReader does with a line longer than its maximum length */
+enum class Overflow {
+    truncate,  // Drop the rest of the line
+    split,     // Return the rest of the line as further lines
+    error      // Stop reading, as if the file had ended before the line
+};
+
+/** Options for LineReader, applied while each line is scanned so that
+    memory stays bounded and skipped text is never copied */
+struct LineOptions {
+    size_t maxLength = std::string::npos;
+    Overflow overflow = Overflow::truncate;
+
+    /** Strip spaces, tabs and any \r or \n that isn't part of the newline
+        from both ends of each line */
+    bool trim = false;
+
+    /** Skip lines that are empty, after trimming */
+    bool skipEmpty = false;
+
+    /** Skip lines that start with this, after trimming: for example "#" */
+    std::string skipPrefix;
+};
+
+/** Where a LineReader was in a file, so reading can be resumed later */
+struct Checkpoint {
+    size_t offset;  // The byte offset of the next line
+    size_t line;    // The zero-based number of the next line
+    FileId file;
+};
+
 /** Read lines from a reader, taking newlines into account */
 template <Newline NL, typename Reader>
-class LineReader {
+class LineReader : public Pipeline<LineReader<NL, Reader>> {
   public:
-    LineReader(Reader& reader) : reader_(reader) {}
+    LineReader(Reader& reader)
+            : reader_(reader), offset_(reader.tell()), line_(0) {}
+
+    /** Resume reading from a checkpoint taken on the same file.
+
+        Throws if the checkpoint is from a different file or past its end
+        and exceptions are enabled - otherwise reads from the start.
+     */
+    LineReader(Reader& reader, const Checkpoint&);
+
+    /** Return the byte offset of the next line in the file */
+    size_t offset() const { return offset_; }
+
+    /** Return the zero-based number of the next line */
+    size_t lineNumber() const { return line_; }
+
+    /** Return a Checkpoint to resume reading after the last line read */
+    Checkpoint checkpoint() { return {offset_, line_, reader_.fileId()}; }
+
+    /** Validate each line as UTF-8 as soon as it is read.  The first
+        invalid line stops reading, as if the file had ended there.  Lines
+        longer than LineOptions::maxLength are then cut between characters,
+        rather than after exactly maxLength bytes. */
+    LineReader& validateUtf8(bool validate = true) {
+        validate_ = validate;
+        return *this;
+    }
+
+    /** Return the file offset of the first invalid UTF-8 byte found, or
+        std::string::npos if none has been */
+    size_t invalidOffset() const { return invalid_; }
+
+    /** Set the options for reading lines */
+    LineReader& options(const LineOptions& options) {
+        options_ = options;
+        return *this;
+    }
+
+    /** Return the file offset of the line that was too long if the options
+        say that is an error, or std::string::npos */
+    size_t overflowOffset() const { return overflow_; }
+
+    /** Only read the lines that start in the byte range [begin, end).
+
+        Unless `begin` is 0, this seeks to it and skips the partial line
+        there, and the last line read is the one that straddles `end`, so
+        a file cut into adjacent ranges has each line read exactly once.
+        Line numbers count from the start of the range.
+     */
+    LineReader& range(size_t begin, size_t end);
+
+    /** Feed each line to a pipeline sink until it returns false */
+    template <typename Sink>
+    void run(Sink&);
 
     /** Try to read a single line, return true if successful */
     bool readOne(std::string&);
@@ -251,7 +542,21 @@ class LineReader {
     Container read();
 
   private:
+    bool endsWithNewline(const std::string&);
+    bool scan(std::string& line, size_t limit, size_t& bytes);
+    void skipRest(std::string& line, size_t& bytes);
+    bool isSpace(char);
+    static size_t utf8Cut(const std::string& line, size_t maxLength);
+
     Reader& reader_;
+    size_t offset_;
+    size_t line_;
+    bool validate_ = false;
+    size_t invalid_ = std::string::npos;
+    LineOptions options_;
+    size_t overflow_ = std::string::npos;
+    std::string pending_;  // The rest of a line that was split
+    size_t end_ = std::string::npos;
 };
 
 /** Write lines to a writer, adding newlines */
@@ -275,324 +580,4281 @@ class LineWriter {
     Writer& writer_;
 };
 
-//
-// Implementation details follow
-//
+/**
+   Read an ordered list of files as one stream, for example rolled log
+   segments oldest first.
 
-template <template <typename> class ... Mixins>
-FileHandle<Mixins...>::FileHandle(const char* filename, const char* mode)
-        : file_(fopen(filename, mode)) {
-#ifdef __cpp_exceptions
-    if (not file_)
-        throw std::runtime_error(filename);
-#endif
-}
+       tfile::ConcatReader reader({"app.log.2", "app.log.1", "app.log"});
+       reader.lines().forEach([] (const std::string& line) { ... });
 
-template <template <typename> class ... Mixins>
-int FileHandle<Mixins...>::close() {
-    int result = 0;
-    if (file_) {
-        result = fclose(file_);
-        file_ = nullptr;
-    }
-    return result;
-}
+   Lines split between files are joined.  The next file is opened and
+   its readahead started while the current one is being read.  Offsets,
+   for seek and for LineReader ranges, are in the concatenated stream.
+*/
+class ConcatReader {
+  public:
+    explicit ConcatReader(const std::vector<std::string>& filenames);
 
-template <template <typename> class ... Mixins>
-void FileHandle<Mixins...>::set(FILE* file) {
-    close();
-    file_ = file;
-}
+    size_t read(char* data, size_t length);
 
-template <template <typename> class ... Mixins>
-FILE* FileHandle<Mixins...>::release() {
-    auto f = file_;
-    file_ = nullptr;
-    return f;
-}
+    /** Like ReaderBase::readUntil, crossing from file to file */
+    size_t readUntil(std::string& s, char delimiter,
+                     size_t maxLength = std::string::npos);
 
-template <template <typename> class ... Mixins>
-int FileHandle<Mixins...>::seek(off_t offset, int whence) {
-    return fseeko(file_, offset, whence);
-}
+    off_t tell();
+    int seek(off_t offset, int whence = SEEK_SET);
 
-template <typename Derived>
-size_t ReaderBase<Derived>::read(char* data, size_t length) {
-    auto fp = static_cast<Derived*>(this)->get();
-    return fread(data, 1, length, fp);
-}
+    /** Return the total size of the files when the reader was created */
+    size_t size() const { return starts_.back(); }
 
-template <typename Derived>
-size_t ReaderBase<Derived>::read(std::string& s) {
-    return read(&s[0], s.size());
-}
+    template <Newline NL = Newline::system>
+    LineReader<NL, ConcatReader> lines() { return {*this}; }
 
-template <typename Derived>
-std::string ReaderBase<Derived>::read(size_t size) {
-    std::string result(size, '\0');
-    result.resize(read(result));
-    return result;
-}
+    template <Newline NL = Newline::system>
+    LineReader<NL, ConcatReader> lines(size_t begin, size_t end);
 
-template <Newline NL, typename Reader>
-bool LineReader<NL, Reader>::readOne(std::string& line) {
-    static const auto newline = newlineString<NL>();
-    static const auto len = strlen(newline);
+  private:
+    bool open(size_t index);
+    bool advance() { return open(index_ + 1); }
 
-    size_t seen = 0;  // How many characters have we seen in newline?
-    bool empty = true;
-    line.resize(0);
+    std::vector<std::string> filenames_;
+    std::vector<size_t> starts_;
+    size_t index_ = 0;
+    FileHandle<ReaderBase> current_;
+    FileHandle<ReaderBase> next_;
+};
 
-    // Emit a partial newline if any
-    auto emitPartial = [&] () {
-        if (seen) {
-            for (size_t i = 0; i < seen; ++i)
-                line += newline[i];
-            seen = 0;
-        }
-    };
+/**
+   Write a file through a shared memory mapping that grows as needed.
 
-    while (true) {
-        char ch;
-        if (not reader_.read(&ch, 1)) {
-            emitPartial();
-            return not empty;
-        }
+   Data can be appended with write(), or formatted in place into the memory
+   returned by append(), and anything already written can be patched
+   through data().  The file is grown and remapped in large increments,
+   and is truncated to exactly size() bytes when closed.
 
-        empty = false;
-        if (ch == newline[seen]) {
-            if (++seen >= len)
-                return true;
-        } else {
-            emitPartial();
-            line += ch;
-        }
-    }
-}
+   Growth allocates real disk blocks with posix_fallocate rather than
+   leaving a sparse hole, so a full disk is reported when the file grows,
+   instead of killing the process with SIGBUS on a later store into the
+   mapping.  Failures to grow throw if exceptions are enabled, and
+   otherwise make write() return 0 and append() return nullptr.
+*/
+class MappedWriter {
+  public:
+    MappedWriter() {}
+    explicit MappedWriter(const char* filename);
+    MappedWriter(MappedWriter&&) noexcept;
+    MappedWriter(const MappedWriter&) = delete;
+    ~MappedWriter() { close(); }
 
-template <Newline NL, typename Reader>
-template <typename Function>
-void LineReader<NL, Reader>::forEach(Function f) {
-    std::string s;
-    while (readOne(s))
-        f(s);
-}
+    MappedWriter& operator=(MappedWriter&&);
+    MappedWriter& operator=(const MappedWriter&) = delete;
 
-template <Newline NL, typename Reader>
-template <typename InserterIt>
-void LineReader<NL, Reader>::fill(InserterIt begin) {
-    forEach([&] (const std::string& s) {
-        *begin = s;
-    });
-}
+    /** Append bytes to the end of the file */
+    size_t write(const char* data, size_t length);
+    size_t write(const std::string&);
 
-template <Newline NL, typename Reader>
-template <typename Container>
-void LineReader<NL, Reader>::read(Container& c) {
-    fill(std::back_inserter(c));
-}
+    /** Extend the file by `length` bytes and return a pointer to them, or
+        nullptr on failure */
+    char* append(size_t length);
 
-template <Newline NL, typename Reader>
-template <typename Container>
-Container LineReader<NL, Reader>::read() {
-    Container c;
-    read(c);
-    return c;
-}
+    /** Change the logical size of the file: new bytes are zero */
+    bool resize(size_t size);
 
-template <typename Derived>
-template <Newline NL>
-LineReader<NL, ReaderBase<Derived>> ReaderBase<Derived>::lines() {
-    return {*this};
-}
+    /** The start of the mapping: valid until the next write, append or
+        resize */
+    char* data() { return data_; }
 
-template <typename Derived>
-template <Newline NL>
-LineReader<NL, ReaderBase<Derived>> ReaderBase<Derived>::readLines() {
-    return {*this};
-}
+    /** The logical size of the file */
+    size_t size() const { return size_; }
 
-template <Newline NL, typename Writer>
-size_t LineWriter<NL, Writer>::writeOne(const std::string& s) {
-    return writer_.write(s) + writer_.write(newlineString<NL>());
-}
+    /** Unmap, truncate to the logical size and close the file */
+    int close();
 
-/** Write a container of lines, adding newlines */
-template <Newline NL, typename Writer>
-template <typename Container>
-size_t LineWriter<NL, Writer>::write(Container c) {
-    using std::begin;
-    using std::end;
-    return write(begin(c), end(c));
-}
+  private:
+    bool reserve(size_t capacity);
 
-/** Write a container of lines, adding newlines */
-template <Newline NL, typename Writer>
-template <typename ForwardIt>
-size_t LineWriter<NL, Writer>::write(ForwardIt begin, ForwardIt end) {
-    size_t size = 0;
-    for (; begin != end; ++begin)
-        size += writeOne(*begin);
-    return size;
-}
+    int fd_ = -1;
+    char* data_ = nullptr;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+};
 
-template <typename Derived>
-template <Newline NL>
-LineWriter<NL, WriterBase<Derived>> WriterBase<Derived>::lines() {
-    return {*this};
-}
+/**
+   An Appender that stays open and rotates its file by size or age.
 
-template <typename Derived>
-template <Newline NL>
-LineWriter<NL, WriterBase<Derived>> WriterBase<Derived>::writeLines() {
-    return {*this};
-}
+   When a write would take the file past `maxBytes`, or `maxAge` has passed
+   since it was opened, `name` is renamed to the next segment, and a fresh
+   `name` is opened.  Reopening an existing file starts its age again.  Segments are numbered `name.1`, `name.2` and so on in the
+   order they were rotated out, continuing from any segments already there,
+   so a segment never changes its name.  Between rotations a write is one
+   fwrite: no reopening and no stat.
 
-template <typename Derived>
-size_t WriterBase<Derived>::write(const char* data, size_t length) {
-    auto fp = static_cast<Derived*>(this)->get();
-    return fwrite(data, 1, length, fp);
-}
+   Only the newest `keep` segments are kept.  An older segment is deleted
+   together with any files made from it named with a further suffix, like
+   `name.3.gz`.
 
-template <typename Derived>
-size_t WriterBase<Derived>::write(const char* data) {
-    return write(data, strlen(data));
-}
+   If `onRotate` is set, it's called with the name of each segment that
+   has been rotated out, for example to compress it.  The calls are queued
+   and run one at a time, in order, on a background thread, so a slow
+   callback never holds up a write.
 
-template <typename Derived>
-size_t WriterBase<Derived>::write(const std::string& s) {
-    return write(s.data(), s.size());
-}
+   If `name` can't be renamed or removed, rotating throws, or without
+   exceptions returns false, and writing carries on into the same file.
+*/
+class RotatingAppender {
+  public:
+    using Callback = std::function<void(const std::string&)>;
 
-template <Mode>
-struct Traits {
-    struct Base;
-};
+    RotatingAppender(const char* filename, size_t maxBytes,
+                     std::chrono::seconds maxAge = std::chrono::seconds(0),
+                     size_t keep = 5, Callback onRotate = nullptr);
+    ~RotatingAppender();
 
-using Read = FileHandle<ReaderBase>;
-using Write = FileHandle<WriterBase>;
-using ReadWrite = FileHandle<ReaderBase, WriterBase>;
+    /** Each write goes entirely into one segment */
+    size_t write(const char* data, size_t length);
+    size_t write(const char* data);
+    size_t write(const std::string&);
+
+    /** Write a line and its newline into one segment */
+    template <Newline NL = Newline::system>
+    size_t writeLine(const std::string&);
+
+    /** Rotate the file now, returning false if it couldn't be renamed */
+    bool rotate();
+
+    /** Flush the stdio buffer */
+    int flush() { return fflush(file_.get()); }
+
+  private:
+    void open();
+    void rotateIfNeeded(size_t length);
+    std::string segment(size_t number) const;
+    void prune(size_t newest);
+    void work();
+
+    std::string filename_;
+    size_t maxBytes_;
+    std::chrono::seconds maxAge_;
+    size_t keep_;
+    Callback onRotate_;
+
+    FileHandle<WriterBase> file_;
+    size_t bytes_ = 0;
+    std::chrono::steady_clock::time_point deadline_;
+    size_t newest_ = 0;  // The number of the newest segment
+
+    // Segments waiting for onRotate_
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::deque<size_t> queue_;
+    bool stopping_ = false;
+    std::thread worker_;
+};
+
+/**
+   Append whole records to a file shared between threads and processes.
+
+   The file is opened with O_APPEND, and each record, or batch of records,
+   is assembled in a thread-local buffer and written with one write(2), so
+   records from different writers never interleave - stdio might split a
+   record over two writes.  No lock is taken in user space.
+
+   On local filesystems, Linux makes each O_APPEND write atomic with respect
+   to other appends, whatever its size.  POSIX itself only promises this for
+   writes of at most PIPE_BUF bytes to pipes, and NFS doesn't support
+   O_APPEND atomically at all.
+*/
+class SharedAppender {
+  public:
+    explicit SharedAppender(const char* filename);
+    SharedAppender(const SharedAppender&) = delete;
+    SharedAppender& operator=(const SharedAppender&) = delete;
+    ~SharedAppender() { close(); }
+
+    /** Write one record */
+    size_t write(const char* data, size_t length);
+    size_t write(const std::string&);
+
+    /** Write a line and its newline as one record */
+    template <Newline NL = Newline::system>
+    size_t writeLine(const std::string&);
+
+    /** Write a container of lines, with newlines, as one record */
+    template <Newline NL = Newline::system, typename Container = Lines>
+    size_t writeLines(const Container&);
+
+    int close();
+
+  private:
+    static std::string& buffer();
+
+    int fd_;
+};
+
+/**
+   A std::streambuf over the file descriptor of a tfile handle, for code
+   that needs a std::istream or std::ostream.
+
+       tfile::Reader reader("input.txt");
+       tfile::streambuf buf(reader);
+       std::istream in(&buf);
+
+   It reads and writes the descriptor directly through one large buffer,
+   and bulk transfers bigger than the buffer bypass it entirely.  Seeking
+   and telling work through lseek.  The FILE* is resynchronized to the
+   stream's position on destruction.
+*/
+class streambuf : public std::streambuf {
+  public:
+    static const size_t DEFAULT_BUFFER_SIZE = 0x40000;
+
+    /** `mode` is std::ios_base::in or std::ios_base::out.  A `bufferSize`
+        of 0 is taken as 1, as the buffer always holds at least the
+        character that overflowed or was read. */
+    streambuf(FILE*, std::ios_base::openmode,
+              size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+    explicit streambuf(Reader&, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+    explicit streambuf(Writer&, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+    explicit streambuf(Appender&, size_t bufferSize = DEFAULT_BUFFER_SIZE);
+
+    ~streambuf();
+
+  protected:
+    int_type underflow() override;
+    int_type overflow(int_type) override;
+    int sync() override;
+    pos_type seekoff(off_type, std::ios_base::seekdir,
+                     std::ios_base::openmode) override;
+    pos_type seekpos(pos_type, std::ios_base::openmode) override;
+    std::streamsize xsgetn(char*, std::streamsize) override;
+    std::streamsize xsputn(const char*, std::streamsize) override;
+
+  private:
+    bool flushBuffer();
+    ssize_t readSome(char*, size_t);
+
+    FILE* file_;
+    int fd_;
+    bool output_;
+    std::vector<char> buffer_;
+};
+
+/** A string that points into memory owned by something else */
+class StringView {
+  public:
+    StringView() {}
+    StringView(const char* data, size_t size) : data_(data), size_(size) {}
+    StringView(const char* s) : data_(s), size_(strlen(s)) {}
+    StringView(const std::string& s) : data_(s.data()), size_(s.size()) {}
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return not size_; }
+
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+    char operator[](size_t i) const { return data_[i]; }
+
+    std::string str() const { return std::string(data_, size_); }
+    int compare(StringView) const;
+
+  private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+bool operator==(StringView, StringView);
+bool operator!=(StringView, StringView);
+bool operator<(StringView, StringView);
+
+/**
+   Lines saved by saveSnapshot, mapped read-only back into memory.
+
+   Opening a Snapshot is one mmap, whatever the number of lines: there is
+   no parsing and no allocation per line, and pages are only read from disk
+   as lines are used.  The StringViews it returns are valid for as long as
+   the Snapshot is.
+*/
+class Snapshot {
+  public:
+    class iterator;
+
+    Snapshot() {}
+    explicit Snapshot(const char* filename);
+    Snapshot(Snapshot&&) noexcept;
+    Snapshot(const Snapshot&) = delete;
+    ~Snapshot() { close(); }
+
+    Snapshot& operator=(Snapshot&&);
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    size_t size() const { return count_; }
+    bool empty() const { return not count_; }
+    StringView operator[](size_t i) const;
+
+    iterator begin() const;
+    iterator end() const;
+
+    /** Unmap the file, leaving the Snapshot empty */
+    void close();
+
+  private:
+    char* map_ = nullptr;
+    size_t mapSize_ = 0;
+    const uint64_t* offsets_ = nullptr;
+    const char* blob_ = nullptr;
+    size_t count_ = 0;
+};
+
+class Snapshot::iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = StringView;
+    using difference_type = ptrdiff_t;
+    using pointer = const StringView*;
+    using reference = StringView;
+
+    iterator(const Snapshot* snapshot, size_t i)
+            : snapshot_(snapshot), i_(i) {}
+
+    StringView operator*() const { return (*snapshot_)[i_]; }
+    iterator& operator++() { ++i_; return *this; }
+    iterator operator++(int) { auto it = *this; ++i_; return it; }
+
+    bool operator==(const iterator& x) const { return i_ == x.i_; }
+    bool operator!=(const iterator& x) const { return i_ != x.i_; }
+
+  private:
+    const Snapshot* snapshot_;
+    size_t i_;
+};
+
+/** Save a container of strings as a Snapshot file: a header, a table of
+    offsets and then all the strings back to back, written in a few large
+    writes.  Strings may contain newlines.  The file uses the machine's byte
+    order.  Returns the number of bytes written, or 0 on failure. */
+template <typename Container = Lines>
+size_t saveSnapshot(const char* filename, const Container&);
+
+/** Map a file written by saveSnapshot */
+Snapshot loadSnapshot(const char* filename);
+
+/**
+   A compact, read-mostly collection of strings that share long prefixes,
+   such as a sorted list of URLs or paths.
+
+   Strings are front coded in buckets of BUCKET_SIZE: the first string of
+   each bucket is stored whole, and each of the rest as the length of the
+   prefix it shares with the string before it, followed by the rest of its
+   bytes.  All the buckets share one buffer.
+
+   Access by index decodes at most one bucket.  find() needs the strings to
+   have been added in sorted order: it binary searches the bucket heads and
+   then scans a single bucket.
+*/
+class FrontCoded {
+  public:
+    static const size_t BUCKET_SIZE = 16;
+
+    class iterator;
+
+    FrontCoded() {}
+
+    template <typename Container>
+    explicit FrontCoded(const Container&);
+
+    /** Add a string to the end of the collection */
+    void push_back(const std::string&);
+
+    size_t size() const { return size_; }
+    bool empty() const { return not size_; }
+
+    /** Decode the string at `index` */
+    std::string operator[](size_t index) const;
+
+    iterator begin() const;
+    iterator end() const;
+
+    /** Return the index of `key`, or std::string::npos if it's absent */
+    size_t find(const std::string& key) const;
+
+    /** The number of bytes of memory used, roughly */
+    size_t bytes() const;
+
+    /** Release spare capacity once the collection is complete */
+    void shrink_to_fit();
+
+  private:
+    /** Decode the entry at `offset` onto `s`, which holds the previous
+        string, and return the offset of the next entry */
+    size_t decode(size_t offset, bool head, std::string& s) const;
+
+    /** The head of a bucket, without copying it */
+    StringView head(size_t bucket) const;
+
+    std::string data_;
+    std::vector<size_t> buckets_;
+    std::string last_;
+    size_t size_ = 0;
+};
+
+class FrontCoded::iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::string;
+    using difference_type = ptrdiff_t;
+    using pointer = const std::string*;
+    using reference = const std::string&;
+
+    iterator(const FrontCoded* strings, size_t index);
+
+    const std::string& operator*() const { return current_; }
+    const std::string* operator->() const { return &current_; }
+    iterator& operator++();
+
+    bool operator==(const iterator& x) const { return index_ == x.index_; }
+    bool operator!=(const iterator& x) const { return index_ != x.index_; }
+
+  private:
+    void load(size_t index);
+
+    const FrontCoded* strings_;
+    size_t index_;
+    size_t offset_ = 0;
+    std::string current_;
+};
+
+/** Read a file's lines, usually sorted, into a FrontCoded collection */
+template <Newline NL = Newline::system>
+FrontCoded readFrontCoded(const char* filename);
+
+/**
+   A pool of distinct strings, each stored once however often it's added.
+
+   A Handle stays valid, and keeps pointing to the same string, for as long
+   as the pool exists, so two strings from one pool are equal exactly when
+   their Handles are.  The pool also counts how often each string was
+   interned.
+*/
+class InternPool {
+  public:
+    using Handle = const std::string*;
+    using Counts = std::unordered_map<std::string, size_t>;
+
+    /** Add an occurrence of `s` and return its Handle.  Only a string not
+        already in the pool is copied. */
+    Handle intern(const std::string& s);
+
+    /** The Handle of `s`, or nullptr if it isn't in the pool */
+    Handle find(const std::string& s) const;
+
+    /** How many times `s` has been interned */
+    size_t count(const std::string& s) const;
+
+    /** The number of distinct strings */
+    size_t size() const { return counts_.size(); }
+
+    /** Every distinct string with its count */
+    const Counts& counts() const { return counts_; }
+
+  private:
+    Counts counts_;
+};
+
+/** Read a file's lines into `pool`, returning a Handle for each line in
+    order.  Lines are read into one reused buffer and only new distinct
+    lines are allocated. */
+template <Newline NL = Newline::system>
+std::vector<InternPool::Handle> readInterned(const char* filename,
+                                             InternPool& pool);
+
+/**
+   An open directory, for opening files in it by name.
+
+   Each name is resolved relative to the directory's descriptor with
+   openat(), so a loop over many files in one deep directory doesn't look
+   up every component of the directory's path again for each file.  Any
+   Opener can also be constructed from a Directory and a name.
+
+       tfile::Directory dir("/data/2024/01/01/shards");
+       for (auto& name : names)
+           total += dir.read(name.c_str()).size();
+*/
+class Directory {
+  public:
+    Directory() {}
+    explicit Directory(const char* path);
+
+    /** Open the subdirectory `name` of `parent` */
+    Directory(const Directory& parent, const char* name);
+
+    Directory(Directory&&) noexcept;
+    Directory(const Directory&) = delete;
+    ~Directory() { close(); }
+
+    Directory& operator=(Directory&&);
+    Directory& operator=(const Directory&) = delete;
+
+    /** The directory's descriptor, or -1 */
+    int fd() const { return fd_; }
+
+    /** Open a file in the directory with the flags fopen would use for
+        `mode`, returning nullptr on failure */
+    FILE* open(const char* name, Mode mode) const;
+
+    /** Read an entire file, like tfile::read */
+    std::string read(const char* name) const;
+    void read(const char* name, std::string&) const;
+
+    /** Read a file into lines, like tfile::readLines */
+    Lines readLines(const char* name) const;
+
+    /** Write an entire file, like tfile::write */
+    size_t write(const char* name, const char* data, size_t length) const;
+    size_t write(const char* name, const std::string&) const;
+
+    /** The size in bytes of a file, or (size_t) -1 on failure */
+    size_t size(const char* name) const;
+
+    int close();
+
+  private:
+    void open(int parent, const char* path);
+
+    int fd_ = -1;
+};
+
+/**
+   Runs tasks for tfile's parallel operations.
+
+   Every parallel operation takes an optional Executor*, and uses
+   defaultExecutor() if it's null, so all of them share one set of threads
+   instead of each starting its own.  An application can pass its own
+   Executor to share its thread pool with tfile.
+
+   A caller waiting for its tasks runs any of them that haven't started
+   yet itself, so operations finish even if the Executor is busy or is
+   itself running the caller.  Tasks must not throw.
+*/
+class Executor {
+  public:
+    using Task = std::function<void()>;
+
+    virtual ~Executor() {}
+
+    /** Run `task` at some point, on some thread */
+    virtual void submit(Task task) = 0;
+
+    /** How many tasks can usefully run at once */
+    virtual size_t concurrency() const = 0;
+};
+
+/**
+   A work-stealing Executor.
+
+   Each worker has its own queue.  Tasks submitted by a worker go on its own
+   queue, which it runs newest first, and others are spread between the
+   queues in turn.  An idle worker steals the oldest task from another.
+*/
+class ThreadPool : public Executor {
+  public:
+    /** `threads` of 0 means one per core */
+    explicit ThreadPool(size_t threads = 0);
+
+    /** Run every task already submitted, then stop the workers */
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    void submit(Task) override;
+    size_t concurrency() const override { return workers_.size(); }
+
+  private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void work(size_t index);
+    bool pop(size_t index, Task&);
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<size_t> next_{0};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    size_t pending_ = 0;
+    bool stopping_ = false;
+};
+
+/** The ThreadPool shared by all of tfile, created on first use */
+Executor& defaultExecutor();
+
+/** Sort the lines of a file which may be much larger than memory.
+
+    Runs of lines that fit in half of `memoryBudget` are sorted in parallel
+    and spilled to temporary files while the next run is read, and then all
+    the runs are merged into `out`.  Whenever a few hundred runs have built
+    up, fewer if the limit on open files is low, they are merged into one
+    longer run, so any size of input can be sorted.  Returns the number of
+    bytes written.  If a run or the output can't be written in full, throws
+    or, without exceptions, returns 0.
+ */
+template <Newline NL = Newline::system,
+          typename Compare = std::less<std::string>>
+size_t sortLines(const char* in, const char* out,
+                 size_t memoryBudget = 0x10000000, Compare = Compare(),
+                 Executor* = nullptr);
+
+/** Merge files whose lines are already sorted into one sorted file.
+
+    If `unique` is true, only the first of a series of equal lines is
+    written.  `memoryBudget` is split between the read buffers of the
+    inputs.  Returns the number of bytes written.  If an input can't be
+    opened or the output can't be written in full, throws or, without
+    exceptions, returns 0.
+ */
+template <Newline NL = Newline::system,
+          typename Compare = std::less<std::string>>
+size_t mergeSorted(const std::vector<std::string>& inputs, const char* output,
+                   Compare = Compare(), bool unique = false,
+                   size_t memoryBudget = 0x4000000);
+
+/** Where a search string was found in a file: the byte offset of the match
+    and the zero-based number of the line it starts on. */
+struct Match {
+    size_t offset;
+    size_t line;
+};
+
+/** Find the first occurrence of `needle` in a file.  If there is none,
+    the offset of the Match is std::string::npos. */
+template <Newline NL = Newline::system>
+Match find(const char* filename, const std::string& needle);
+
+/** Find every occurrence of `needle` in a file, including overlapping ones.
+
+    The file is searched in large blocks, split between `threads` tasks:
+    0 means as many as the executor can run at once.
+ */
+template <Newline NL = Newline::system>
+std::vector<Match> findAll(const char* filename, const std::string& needle,
+                           size_t threads = 1, Executor* = nullptr);
+
+/** Count the occurrences of `needle` in a file, like findAll */
+size_t countMatches(const char* filename, const std::string& needle,
+                    size_t threads = 1, Executor* = nullptr);
+
+/** Count the lines in a file, including a last line with no newline */
+template <Newline NL = Newline::system>
+size_t countLines(const char* filename);
+
+/** Split a file into `shards` files of about the same size, each ending on a
+    line boundary, named `filename.0`, `filename.1` and so on.
+
+    Shards are copied in parallel, inside the kernel where possible.
+    Returns the names of the shards.
+ */
+template <Newline NL = Newline::system>
+std::vector<std::string> split(const char* filename, size_t shards,
+                               Executor* = nullptr);
+
+/** Split a file into line-aligned shards of about `shardBytes` each */
+template <Newline NL = Newline::system>
+std::vector<std::string> splitBytes(const char* filename, size_t shardBytes,
+                                    Executor* = nullptr);
+
+/** A regular file found by walk() */
+struct WalkEntry {
+    /** The path of the file, starting with the root that was walked */
+    std::string path;
+
+    /** The directory holding the file, open for openat() and fstatat()
+        until the visitor returns, and the file's name in it */
+    int directory;
+    const char* name;
+
+    size_t size;
+};
+
+using Visitor = std::function<void(const WalkEntry&)>;
+
+/** Call `visitor` for every regular file under the directory `root`.
+
+    Directories are read in parallel on the executor, each through a
+    descriptor opened relative to its parent's, and each file is stat'ed
+    relative to its directory, so no path is resolved twice.  Files are
+    stat'ed and visited in batches run on the executor, so the visitor is
+    called from several threads at once, even for one directory.
+    Symbolic links aren't followed, and directories that can't be opened
+    are skipped.  Directories are read depth first, to keep few of them
+    open, and one that can't be opened for want of descriptors is retried
+    after the others being read have closed theirs.  Returns the number of
+    files visited.  If the visitor throws, the walk stops as soon as the
+    tasks in progress notice, and walk() rethrows the first exception.
+ */
+size_t walk(const char* root, Visitor visitor, Executor* = nullptr);
+
+enum class Sampling {
+    /** Seek to random offsets, without reading the whole file.  Each offset
+        picks the line it falls in, which is kept with a probability
+        inversely proportional to its length, to cancel out the bias towards
+        long lines.  The shortest line seen so far stands in for the
+        unknown shortest line in the file, so the first few lines drawn are
+        slightly more likely to be long. */
+    approximate,
+
+    /** Read the whole file once, keeping a uniform reservoir of lines */
+    exact
+};
+
+/** Return up to `k` different lines of a file, chosen at random */
+template <Newline NL = Newline::system>
+Lines sampleLines(const char* filename, size_t k, uint64_t seed = 0,
+                  Sampling = Sampling::approximate);
+
+/** The default key for lookupSorted: the whole line */
+struct WholeLine {
+    const std::string& operator()(const std::string& line) const {
+        return line;
+    }
+};
+
+/** Binary search a file whose lines are sorted by key, reading O(log n)
+    lines through pread and no index.  If a line's key equals `key`, set
+    `line` to the first such line and return true. */
+template <Newline NL = Newline::system, typename KeyFunction = WholeLine,
+          typename Compare = std::less<std::string>>
+bool lookupSorted(const char* filename, const std::string& key,
+                  std::string& line, KeyFunction = KeyFunction(),
+                  Compare = Compare());
+
+struct Lookup {
+    bool found;
+    std::string line;
+};
+
+/** Look up many keys at once, returning a result for each key in order.
+    The keys are sorted first, so each search starts where the last one
+    ended. */
+template <Newline NL = Newline::system, typename KeyFunction = WholeLine,
+          typename Compare = std::less<std::string>>
+std::vector<Lookup> lookupSorted(const char* filename,
+                                 const std::vector<std::string>& keys,
+                                 KeyFunction = KeyFunction(),
+                                 Compare = Compare());
+
+//
+// Implementation details follow
+//
+
+template <template <typename> class ... Mixins>
+FileHandle<Mixins...>::FileHandle(const char* filename, const char* mode)
+        : file_(fopen(filename, mode)) {
+#ifdef __cpp_exceptions
+    if (not file_)
+        throw std::runtime_error(filename);
+#endif
+}
+
+template <template <typename> class ... Mixins>
+int FileHandle<Mixins...>::close() {
+    int result = 0;
+    if (file_) {
+        result = fclose(file_);
+        file_ = nullptr;
+    }
+    return result;
+}
+
+template <template <typename> class ... Mixins>
+void FileHandle<Mixins...>::set(FILE* file) {
+    close();
+    file_ = file;
+}
+
+template <template <typename> class ... Mixins>
+FILE* FileHandle<Mixins...>::release() {
+    auto f = file_;
+    file_ = nullptr;
+    return f;
+}
+
+template <template <typename> class ... Mixins>
+int FileHandle<Mixins...>::seek(off_t offset, int whence) {
+    return fseeko(file_, offset, whence);
+}
+
+template <typename Derived>
+size_t ReaderBase<Derived>::read(char* data, size_t length) {
+    auto fp = static_cast<Derived*>(this)->get();
+    return fread(data, 1, length, fp);
+}
+
+template <typename Derived>
+size_t ReaderBase<Derived>::read(std::string& s) {
+    return read(&s[0], s.size());
+}
+
+template <typename Derived>
+std::string ReaderBase<Derived>::read(size_t size) {
+    std::string result(size, '\0');
+    result.resize(read(result));
+    return result;
+}
+
+template <typename Derived>
+size_t ReaderBase<Derived>::readUntil(
+        std::string& s, char delimiter, size_t maxLength) {
+    auto fp = static_cast<Derived*>(this)->get();
+    auto size = s.size();
+
+    // One lock for the whole scan instead of one per character.
+    flockfile(fp);
+    int ch;
+    while (maxLength-- and (ch = getc_unlocked(fp)) != EOF) {
+        s += static_cast<char>(ch);
+        if (ch == static_cast<unsigned char>(delimiter))
+            break;
+    }
+    funlockfile(fp);
+    return s.size() - size;
+}
+
+template <typename Derived>
+off_t ReaderBase<Derived>::tell() {
+    return ftello(static_cast<Derived*>(this)->get());
+}
+
+template <typename Derived>
+int ReaderBase<Derived>::seek(off_t offset, int whence) {
+    return fseeko(static_cast<Derived*>(this)->get(), offset, whence);
+}
+
+template <typename Derived>
+FileId ReaderBase<Derived>::fileId() {
+    struct stat st;
+    if (fstat(fileno(static_cast<Derived*>(this)->get()), &st))
+        return {0, 0};
+    return {st.st_dev, st.st_ino};
+}
+
+template <Newline NL, typename Reader>
+bool LineReader<NL, Reader>::endsWithNewline(const std::string& line) {
+    static const auto newline = newlineString<NL>();
+    static const auto len = strlen(newline);
+
+    auto size = line.size();
+    return size >= len and not line.compare(size - len, len, newline);
+}
+
+template <Newline NL, typename Reader>
+bool LineReader<NL, Reader>::isSpace(char c) {
+    static const auto newline = newlineString<NL>();
+    return strchr(" \t\r\n\f\v", c) and not strchr(newline, c);
+}
+
+/** Scan until the line has a newline, which is removed, or reaches `limit`
+    bytes, or the file ends.  Return true if there was a newline. */
+template <Newline NL, typename Reader>
+bool LineReader<NL, Reader>::scan(
+        std::string& line, size_t limit, size_t& bytes) {
+    static const auto newline = newlineString<NL>();
+    static const auto len = strlen(newline);
+
+    // Scan to the last character of the newline, then check the rest of it.
+    while (line.size() < limit) {
+        auto n = reader_.readUntil(line, newline[len - 1], limit - line.size());
+        if (not n)
+            return false;
+        bytes += n;
+        if (endsWithNewline(line)) {
+            line.resize(line.size() - len);
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Where to cut a line that's longer than `maxLength` so as not to split a
+    UTF-8 character: before the character that crosses `maxLength`, or
+    after it if it's the first one and all of it has been scanned */
+template <Newline NL, typename Reader>
+size_t LineReader<NL, Reader>::utf8Cut(
+        const std::string& line, size_t maxLength) {
+    auto continues = [&] (size_t i) {
+        return (static_cast<unsigned char>(line[i]) & 0xc0) == 0x80;
+    };
+
+    auto cut = maxLength;
+    while (cut and continues(cut))
+        --cut;
+    if (cut)
+        return cut;
+
+    cut = maxLength;
+    while (cut < line.size() and continues(cut))
+        ++cut;
+    return cut < line.size() ? cut : maxLength;
+}
+
+/** Discard the rest of the line without building it */
+template <Newline NL, typename Reader>
+void LineReader<NL, Reader>::skipRest(std::string& line, size_t& bytes) {
+    static const size_t BLOCK_SIZE = 0x1000;
+    static const auto newline = newlineString<NL>();
+    static const auto len = strlen(newline);
+
+    while (true) {
+        // Keep just enough to spot a newline split between blocks.
+        if (line.size() >= len)
+            line.erase(0, line.size() - len + 1);
+        auto n = reader_.readUntil(line, newline[len - 1], BLOCK_SIZE);
+        bytes += n;
+        if (not n or endsWithNewline(line))
+            return;
+    }
+}
+
+template <Newline NL, typename Reader>
+bool LineReader<NL, Reader>::readOne(std::string& line) {
+    static const auto npos = std::string::npos;
+    static const auto len = strlen(newlineString<NL>());
+    auto& o = options_;
+
+    while (true) {
+        line.resize(0);
+        if (invalid_ != npos or overflow_ != npos or offset_ >= end_)
+            return false;
+
+        // A split line's later pieces continue it: only the first piece is
+        // trimmed at the front, or checked for skipPrefix.
+        auto first = pending_.empty();
+        line.swap(pending_);
+        size_t bytes = line.size();
+        size_t trimmed = 0;
+        bool complete = false;
+
+        if (o.trim and first) {
+            // Drop leading whitespace as it's scanned.
+            while (true) {
+                size_t i = 0;
+                while (i < line.size() and isSpace(line[i]))
+                    ++i;
+                line.erase(0, i);
+                trimmed += i;
+                if (complete or not line.empty())
+                    break;
+                auto before = bytes;
+                complete = scan(line, 1, bytes);
+                if (bytes == before)
+                    break;
+            }
+        }
+
+        if (not o.skipPrefix.empty() and first) {
+            auto size = o.skipPrefix.size();
+            if (not complete)
+                complete = scan(line, size, bytes);
+            if (not line.compare(0, size, o.skipPrefix)) {
+                if (not complete)
+                    skipRest(line, bytes);
+                offset_ += bytes;
+                ++line_;
+                continue;
+            }
+        }
+
+        auto limit = o.maxLength == npos ? npos : o.maxLength + len;
+        if (not complete)
+            complete = scan(line, limit, bytes);
+
+        if (not complete and line.size() > o.maxLength) {
+            if (o.overflow == Overflow::error) {
+                overflow_ = offset_;
+                line.resize(0);
+                return false;
+            }
+            auto cut = validate_ ? utf8Cut(line, o.maxLength) : o.maxLength;
+            pending_.assign(line, cut, npos);
+            line.resize(cut);
+            if (o.overflow == Overflow::split) {
+                bytes -= pending_.size();
+            } else {
+                skipRest(pending_, bytes);
+                pending_.clear();
+                complete = true;
+            }
+        }
+
+        if (not bytes)
+            return false;
+
+        // Only the last piece of a line is trimmed at the back.
+        auto last = pending_.empty();
+        if (o.trim and last) {
+            auto size = line.size();
+            while (size and isSpace(line[size - 1]))
+                --size;
+            line.resize(size);
+        }
+
+        // An empty line is skipped only if it's a whole line.  A last piece
+        // left empty by trimming is skipped too, as it was all whitespace.
+        auto skip = first ? o.skipEmpty : o.trim;
+        if (skip and last and line.empty()) {
+            offset_ += bytes;
+            ++line_;
+            continue;
+        }
+
+        // Validate while the line is still in cache.
+        if (validate_) {
+            auto invalid = tfile::validateUtf8(line.data(), line.size());
+            if (invalid != npos) {
+                invalid_ = offset_ + trimmed + invalid;
+                line.resize(0);
+                return false;
+            }
+        }
+
+        offset_ += bytes;
+        line_ += pending_.empty();
+        return true;
+    }
+}
+
+template <Newline NL, typename Reader>
+LineReader<NL, Reader>& LineReader<NL, Reader>::range(
+        size_t begin, size_t end) {
+    static const auto len = strlen(newlineString<NL>());
+
+    // A newline that ends just before `begin` starts at `begin - len`.
+    offset_ = begin > len ? begin - len : 0;
+    line_ = 0;
+    end_ = end;
+    pending_.clear();
+    reader_.seek(offset_);
+
+    if (begin) {
+        std::string scratch;
+        size_t bytes = 0;
+        skipRest(scratch, bytes);
+        offset_ += bytes;
+    }
+    return *this;
+}
+
+template <Newline NL, typename Reader>
+LineReader<NL, Reader>::LineReader(Reader& reader, const Checkpoint& c)
+        : reader_(reader), offset_(0), line_(0) {
+    auto end = reader_.seek(0, SEEK_END) ? 0 : reader_.tell();
+    if (reader_.fileId() == c.file and c.offset <= size_t(end)) {
+        offset_ = c.offset;
+        line_ = c.line;
+    } else {
+#ifdef __cpp_exceptions
+        throw std::runtime_error("Checkpoint does not match the file");
+#endif
+    }
+    reader_.seek(offset_);
+}
+
+template <Newline NL, typename Reader>
+template <typename Function>
+void LineReader<NL, Reader>::forEach(Function f) {
+    std::string s;
+    while (readOne(s))
+        f(s);
+}
+
+template <Newline NL, typename Reader>
+template <typename Sink>
+void LineReader<NL, Reader>::run(Sink& sink) {
+    std::string s;
+    while (readOne(s) and sink(s));
+}
+
+template <typename Predicate, typename Sink>
+struct FilterSink {
+    Predicate& predicate;
+    Sink& sink;
+
+    template <typename T>
+    bool operator()(T&& item) {
+        return not predicate(item) or sink(std::forward<T>(item));
+    }
+};
+
+template <typename Function, typename Sink>
+struct MapSink {
+    Function& function;
+    Sink& sink;
+
+    template <typename T>
+    bool operator()(T&& item) {
+        return sink(function(std::forward<T>(item)));
+    }
+};
+
+template <typename Sink>
+struct TakeSink {
+    size_t remaining;
+    Sink& sink;
+
+    template <typename T>
+    bool operator()(T&& item) {
+        return sink(std::forward<T>(item)) and --remaining;
+    }
+};
+
+template <typename Function>
+struct ForEachSink {
+    Function& function;
+
+    template <typename T>
+    bool operator()(T&& item) {
+        function(std::forward<T>(item));
+        return true;
+    }
+};
+
+template <typename Source, typename Predicate>
+template <typename Sink>
+void Filter<Source, Predicate>::run(Sink& sink) {
+    FilterSink<Predicate, Sink> filterSink{predicate_, sink};
+    source_.run(filterSink);
+}
+
+template <typename Source, typename Function>
+template <typename Sink>
+void Map<Source, Function>::run(Sink& sink) {
+    MapSink<Function, Sink> mapSink{function_, sink};
+    source_.run(mapSink);
+}
+
+template <typename Source>
+template <typename Sink>
+void Take<Source>::run(Sink& sink) {
+    TakeSink<Sink> takeSink{count_, sink};
+    if (count_)
+        source_.run(takeSink);
+}
+
+template <typename Derived>
+template <typename Predicate>
+Filter<Derived&, Predicate> Pipeline<Derived>::filter(Predicate predicate) & {
+    return {*static_cast<Derived*>(this), predicate};
+}
+
+template <typename Derived>
+template <typename Predicate>
+Filter<Derived, Predicate> Pipeline<Derived>::filter(Predicate predicate) && {
+    return {std::move(*static_cast<Derived*>(this)), predicate};
+}
+
+template <typename Derived>
+template <typename Function>
+Map<Derived&, Function> Pipeline<Derived>::map(Function function) & {
+    return {*static_cast<Derived*>(this), function};
+}
+
+template <typename Derived>
+template <typename Function>
+Map<Derived, Function> Pipeline<Derived>::map(Function function) && {
+    return {std::move(*static_cast<Derived*>(this)), function};
+}
+
+template <typename Derived>
+Take<Derived&> Pipeline<Derived>::take(size_t count) & {
+    return {*static_cast<Derived*>(this), count};
+}
+
+template <typename Derived>
+Take<Derived> Pipeline<Derived>::take(size_t count) && {
+    return {std::move(*static_cast<Derived*>(this)), count};
+}
+
+template <typename Derived>
+template <typename Function>
+void Pipeline<Derived>::forEach(Function function) {
+    ForEachSink<Function> sink{function};
+    static_cast<Derived*>(this)->run(sink);
+}
+
+template <Newline NL, typename Reader>
+template <typename InserterIt>
+void LineReader<NL, Reader>::fill(InserterIt begin) {
+    forEach([&] (const std::string& s) {
+        *begin = s;
+    });
+}
+
+template <Newline NL, typename Reader>
+template <typename Container>
+void LineReader<NL, Reader>::read(Container& c) {
+    fill(std::back_inserter(c));
+}
+
+template <Newline NL, typename Reader>
+template <typename Container>
+Container LineReader<NL, Reader>::read() {
+    Container c;
+    read(c);
+    return c;
+}
+
+template <typename Derived>
+template <Newline NL>
+LineReader<NL, ReaderBase<Derived>> ReaderBase<Derived>::lines() {
+    return {*this};
+}
+
+template <typename Derived>
+template <Newline NL>
+LineReader<NL, ReaderBase<Derived>> ReaderBase<Derived>::lines(
+        size_t begin, size_t end) {
+    LineReader<NL, ReaderBase> reader(*this);
+    reader.range(begin, end);
+    return reader;
+}
+
+template <typename Derived>
+template <Newline NL>
+LineReader<NL, ReaderBase<Derived>> ReaderBase<Derived>::readLines() {
+    return {*this};
+}
+
+template <Newline NL, typename Writer>
+size_t LineWriter<NL, Writer>::writeOne(const std::string& s) {
+    return writer_.write(s) + writer_.write(newlineString<NL>());
+}
+
+/** Write a container of lines, adding newlines */
+template <Newline NL, typename Writer>
+template <typename Container>
+size_t LineWriter<NL, Writer>::write(Container c) {
+    using std::begin;
+    using std::end;
+    return write(begin(c), end(c));
+}
+
+/** Write a container of lines, adding newlines */
+template <Newline NL, typename Writer>
+template <typename ForwardIt>
+size_t LineWriter<NL, Writer>::write(ForwardIt begin, ForwardIt end) {
+    size_t size = 0;
+    for (; begin != end; ++begin)
+        size += writeOne(*begin);
+    return size;
+}
+
+template <typename Derived>
+template <Newline NL>
+LineWriter<NL, WriterBase<Derived>> WriterBase<Derived>::lines() {
+    return {*this};
+}
+
+template <typename Derived>
+template <Newline NL>
+LineWriter<NL, WriterBase<Derived>> WriterBase<Derived>::writeLines() {
+    return {*this};
+}
+
+template <typename Derived>
+size_t WriterBase<Derived>::write(const char* data, size_t length) {
+    auto fp = static_cast<Derived*>(this)->get();
+    return fwrite(data, 1, length, fp);
+}
+
+template <typename Derived>
+size_t WriterBase<Derived>::write(const char* data) {
+    return write(data, strlen(data));
+}
+
+template <typename Derived>
+size_t WriterBase<Derived>::write(const std::string& s) {
+    return write(s.data(), s.size());
+}
+
+template <typename Derived>
+int WriterBase<Derived>::preallocate(size_t length) {
+#ifdef __linux__
+    auto fp = static_cast<Derived*>(this)->get();
+    auto offset = ftello(fp);
+    if (offset < 0)
+        return errno;
+
+    // Unlike posix_fallocate, fallocate never falls back to writing zeroes.
+    auto fd = fileno(fp);
+    return fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, length) ? errno : 0;
+#else
+    return ENOTSUP;
+#endif
+}
+
+template <Mode>
+struct Traits {
+    struct Base;
+};
+
+using Read = FileHandle<ReaderBase>;
+using Write = FileHandle<WriterBase>;
+using ReadWrite = FileHandle<ReaderBase, WriterBase>;
+
+template <> struct Traits<Mode::read> { using Base = Read; };
+template <> struct Traits<Mode::readWrite> { using Base = ReadWrite; };
+template <> struct Traits<Mode::write> { using Base = Write; };
+template <> struct Traits<Mode::truncate> { using Base = ReadWrite; };
+template <> struct Traits<Mode::append> { using Base = Write; };
+template <> struct Traits<Mode::readAppend> { using Base = ReadWrite; };
+
+template <> const char* newlineString<Newline::atari8>() { return "\x9b"; }
+template <> const char* newlineString<Newline::cr>() { return "\r"; }
+template <> const char* newlineString<Newline::cr_lf>() { return "\r\n"; }
+template <> const char* newlineString<Newline::lf>() { return "\n"; }
+template <> const char* newlineString<Newline::lf_cr>() { return "\n\r"; }
+template <> const char* newlineString<Newline::nl>() { return "\x15"; }
+template <> const char* newlineString<Newline::rs>() { return "\x1e"; }
+template <> const char* newlineString<Newline::zx8x>() { return "\x76"; }
+
+inline
+const char* newlineString(Newline nl) {
+    switch (nl) {
+        case Newline::atari8: return newlineString<Newline::atari8>();
+        case Newline::cr: return newlineString<Newline::cr>();
+        case Newline::cr_lf: return newlineString<Newline::cr_lf>();
+        case Newline::lf: return newlineString<Newline::lf>();
+        case Newline::lf_cr: return newlineString<Newline::lf_cr>();
+        case Newline::nl: return newlineString<Newline::nl>();
+        case Newline::rs: return newlineString<Newline::rs>();
+        case Newline::zx8x: return newlineString<Newline::zx8x>();
+    }
+    return newlineString();
+}
+
+template <> const char* modeString<Mode::read>() { return "r"; }
+template <> const char* modeString<Mode::readWrite>() { return "r+"; }
+template <> const char* modeString<Mode::write>() { return "w"; }
+template <> const char* modeString<Mode::truncate>() { return "w+"; }
+template <> const char* modeString<Mode::append>() { return "a"; }
+template <> const char* modeString<Mode::readAppend>() { return "a+"; }
+
+inline
+const char* modeString(Mode mode) {
+    switch (mode) {
+        case Mode::read: return modeString<Mode::read>();
+        case Mode::readWrite: return modeString<Mode::readWrite>();
+        case Mode::write: return modeString<Mode::write>();
+        case Mode::truncate: return modeString<Mode::truncate>();
+        case Mode::append: return modeString<Mode::append>();
+        case Mode::readAppend: return modeString<Mode::readAppend>();
+    }
+    return modeString<Mode::read>();
+}
+
+template <Mode MODE>
+class Opener : public Traits<MODE>::Base {
+  public:
+    using Base = typename Traits<MODE>::Base;
+
+    Opener() {}
+
+    explicit Opener(const char* filename) : Base(filename, modeString<MODE>()) {}
+
+    /** Open a file by its name in `directory` */
+    Opener(const Directory& directory, const char* name);
+
+    explicit Opener(Opener&& other) noexcept : Base(other.release()) {}
+    Opener(const Opener&) = delete;
+
+    Opener& operator=(Opener&& other) {
+        this->set(other.release());
+        return *this;
+    }
+
+    Opener& operator=(const Opener& other) = delete;
+};
+
+/** Read up to `length` bytes at `offset`, returning fewer only at EOF */
+inline
+size_t readAt(int fd, char* data, size_t length, size_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        auto bytes = pread(fd, data + total, length - total, offset + total);
+        if (bytes < 0 and errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        total += bytes;
+    }
+    return total;
+}
+
+/** Write all of `length` bytes, returning fewer only on error */
+inline
+size_t writeAll(int fd, const char* data, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        auto bytes = ::write(fd, data + total, length - total);
+        if (bytes < 0 and errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        total += bytes;
+    }
+    return total;
+}
+
+/** Write all of `length` bytes at `offset`, returning fewer only on error */
+inline
+size_t writeAt(int fd, const char* data, size_t length, size_t offset) {
+    size_t total = 0;
+    while (total < length) {
+        auto bytes = pwrite(fd, data + total, length - total, offset + total);
+        if (bytes < 0 and errno == EINTR)
+            continue;
+        if (bytes <= 0)
+            break;
+        total += bytes;
+    }
+    return total;
+}
+
+inline
+size_t fileSize(int fd) {
+    struct stat st;
+    return fstat(fd, &st) ? 0 : st.st_size;
+}
+
+template <typename SizeFunction>
+void testableRead(const char* filename, std::string& s, SizeFunction size) {
+    // The file size might change between getting the size and reading it: see
+    // https://www.reddit.com/r/cpp/comments/aiprv9/tiny_file_utilities/eerbyza/
+
+    s.resize(size(filename));
+
+    Reader reader(filename);
+    s.resize(reader.read(s));
+
+    while (true) {
+        static const auto BUFFER_SIZE = 16;
+        char buffer[BUFFER_SIZE];
+        if (auto bytes = reader.read(buffer, BUFFER_SIZE))
+            s.insert(s.end(), buffer, buffer + bytes);
+        else
+            break;
+    }
+}
+
+inline
+void read(const char* filename, std::string& s) {
+    testableRead(filename, s, size);
+}
+
+
+inline
+std::string read(const char* filename) {
+    std::string s;
+    read(filename, s);
+    return s;
+}
+
+inline
+size_t validateUtf8(const char* data, size_t length) {
+    static const uint64_t HIGH_BITS = 0x8080808080808080ULL;
+
+    auto s = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while (i < length) {
+        // Skip runs of ASCII many bytes at a time.
+#ifdef __SSE2__
+        while (i + 16 <= length) {
+            auto block = reinterpret_cast<const __m128i*>(s + i);
+            if (_mm_movemask_epi8(_mm_loadu_si128(block)))
+                break;
+            i += 16;
+        }
+#endif
+        while (i + 8 <= length) {
+            uint64_t word;
+            memcpy(&word, s + i, 8);
+            if (word & HIGH_BITS)
+                break;
+            i += 8;
+        }
+        if (i >= length)
+            break;
+
+        auto c = s[i];
+        if (c < 0x80) {
+            ++i;
+            continue;
+        }
+
+        size_t extra;
+        uint32_t codepoint, minimum;
+        if ((c & 0xE0) == 0xC0) {
+            extra = 1, codepoint = c & 0x1F, minimum = 0x80;
+        } else if ((c & 0xF0) == 0xE0) {
+            extra = 2, codepoint = c & 0x0F, minimum = 0x800;
+        } else if ((c & 0xF8) == 0xF0) {
+            extra = 3, codepoint = c & 0x07, minimum = 0x10000;
+        } else {
+            return i;
+        }
+
+        if (i + extra >= length)
+            return i;
+        for (size_t j = 1; j <= extra; ++j) {
+            if ((s[i + j] & 0xC0) != 0x80)
+                return i;
+            codepoint = (codepoint << 6) | (s[i + j] & 0x3F);
+        }
+
+        // Reject overlong forms, surrogates, and values past Unicode.
+        if (codepoint < minimum or codepoint > 0x10FFFF or
+            (codepoint >= 0xD800 and codepoint <= 0xDFFF)) {
+            return i;
+        }
+        i += extra + 1;
+    }
+    return std::string::npos;
+}
+
+inline
+size_t readUtf8(const char* filename, std::string& s) {
+    static const size_t BLOCK_SIZE = 0x10000;
+
+    Reader reader(filename);
+    s.clear();
+    s.reserve(size(filename) + 1);
+
+    size_t validated = 0;
+    auto invalid = std::string::npos;
+    while (true) {
+        auto size = s.size();
+        s.resize(size + BLOCK_SIZE);
+        auto bytes = reader.read(&s[size], BLOCK_SIZE);
+        s.resize(size + bytes);
+        if (invalid != std::string::npos) {
+            if (bytes)
+                continue;
+            break;
+        }
+
+        // Hold back a character that might continue into the next block.
+        auto end = s.size();
+        if (bytes) {
+            auto b = end;
+            for (int i = 0; i < 3 and b > validated and
+                     (s[b - 1] & 0xC0) == 0x80; ++i) {
+                --b;
+            }
+            if (b > validated and static_cast<unsigned char>(s[b - 1]) >= 0xC0)
+                end = b - 1;
+        }
+
+        auto found = validateUtf8(s.data() + validated, end - validated);
+        if (found != std::string::npos)
+            invalid = validated + found;
+        validated = end;
+
+        if (not bytes)
+            break;
+    }
+    return invalid;
+}
+
+inline
+size_t write(const char* filename, const char* data, size_t length) {
+    Writer writer(filename);
+    writer.preallocate(length);
+    return writer.write(data, length);
+}
+
+inline
+size_t write(const char* filename, const char* data) {
+    return write(filename, data, strlen(data));
+}
+
+inline
+size_t write(const char* filename, const std::string& s) {
+    return write(filename, s.data(), s.size());
+}
+
+/** Write a whole file through a temporary file and a rename, returning
+    false on failure if exceptions are disabled */
+inline
+bool replaceAtomically(const char* filename, const char* data,
+                       size_t length) {
+    static std::atomic<unsigned> counter{0};
+
+    std::string temp;
+    int fd = -1;
+    for (int i = 0; fd < 0 and i < 16; ++i) {
+        temp = filename;
+        temp += ".tfile." + std::to_string(getpid());
+        temp += "." + std::to_string(counter++);
+        // O_EXCL never clobbers another file; 0666 lets umask apply.
+        fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fd < 0 and errno != EEXIST)
+            break;
+    }
+
+    if (fd < 0) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+        return false;
+    }
+
+    // Keep the permissions of any file we are replacing.
+    struct stat st;
+    if (not stat(filename, &st))
+        fchmod(fd, st.st_mode & 07777);
+
+    auto fp = fdopen(fd, "w");
+    if (not fp)
+        ::close(fd);
+
+    Writer writer;
+    writer.set(fp);
+    auto written = fp ? writer.write(data, length) : 0;
+    if (not fp or writer.close() or written != length or
+        rename(temp.c_str(), filename)) {
+        unlink(temp.c_str());
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+        return false;
+    }
+    return true;
+}
+
+inline
+size_t writeAtomic(const char* filename, const char* data, size_t length) {
+    return replaceAtomically(filename, data, length) ? length : 0;
+}
+
+inline
+size_t writeAtomic(const char* filename, const std::string& s) {
+    return writeAtomic(filename, s.data(), s.size());
+}
+
+/** Return true if the rest of the reader is exactly `data` */
+template <typename Reader>
+bool sameContents(Reader& reader, const char* data, size_t length) {
+    static const size_t BUFFER_SIZE = 0x10000;
+    std::vector<char> buffer(BUFFER_SIZE);
+
+    while (true) {
+        auto bytes = reader.read(buffer.data(), BUFFER_SIZE);
+        if (bytes > length or memcmp(buffer.data(), data, bytes))
+            return false;
+        if (not bytes)
+            return not length;
+        data += bytes;
+        length -= bytes;
+    }
+}
+
+inline
+WriteResult writeIfDifferent(
+        const char* filename, const char* data, size_t length) {
+    Reader reader;
+    reader.set(fopen(filename, "r"));
+    if (not reader.get()) {
+        // Only a missing file is created: one we can't read is an error.
+        if (errno == ENOENT) {
+            return replaceAtomically(filename, data, length)
+                    ? WriteResult::created : WriteResult::failed;
+        }
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+        return WriteResult::failed;
+    }
+
+    struct stat st;
+    auto sameSize = not fstat(fileno(reader.get()), &st) and
+        static_cast<size_t>(st.st_size) == length;
+    if (sameSize and sameContents(reader, data, length))
+        return WriteResult::unchanged;
+
+    reader.close();
+    return replaceAtomically(filename, data, length)
+            ? WriteResult::changed : WriteResult::failed;
+}
+
+inline
+WriteResult writeIfDifferent(const char* filename, const std::string& s) {
+    return writeIfDifferent(filename, s.data(), s.size());
+}
+
+inline
+void readLines(const char* filename, Lines& lines) {
+    Reader(filename).lines().read(lines);
+}
+
+inline
+Lines readLines(const char* filename) {
+    return Reader(filename).lines().read();
+}
+
+inline
+void read(const char* filename, size_t offset, size_t length,
+          std::string& s) {
+    Reader reader(filename);
+    s.resize(length);
+    s.resize(readAt(fileno(reader.get()), &s[0], length, offset));
+}
+
+inline
+std::string read(const char* filename, size_t offset, size_t length) {
+    std::string s;
+    read(filename, offset, length, s);
+    return s;
+}
+
+inline
+size_t writeLines(const char* filename, const Lines& lines) {
+    return writeLines<>(filename, lines);
+}
+
+inline
+size_t size(const char* filename) {
+    struct stat st;
+    return stat(filename, &st) ? static_cast<size_t>(-1) : st.st_size;
+}
+
+template <typename Container>
+size_t writeLines(const char* filename, Container c) {
+    using std::begin;
+    using std::end;
+    return writeLines(filename, begin(c), end(c));
+}
+
+inline size_t byteSize(const std::string& s) { return s.size(); }
+inline size_t byteSize(const char* s) { return strlen(s); }
+
+template <typename ForwardIt>
+size_t writeLines(const char* filename, ForwardIt begin, ForwardIt end) {
+    static const size_t MAX_BUFFER_SIZE = 0x100000;
+    static const auto newlineSize = strlen(newlineString());
+
+    size_t length = 0;
+    for (auto i = begin; i != end; ++i)
+        length += byteSize(*i) + newlineSize;
+
+    // Buffer the lines so they go out in a few large writes.
+    Writer writer(filename);
+    auto bufferSize = std::min(length, MAX_BUFFER_SIZE);
+    if (bufferSize > BUFSIZ)
+        setvbuf(writer.get(), nullptr, _IOFBF, bufferSize);
+    writer.preallocate(length);
+    return writer.writeLines().write(begin, end);
+}
+
+inline
+size_t threadCount(size_t maxThreads = 0) {
+    size_t n = std::max(std::thread::hardware_concurrency(), 1u);
+    return maxThreads ? std::min(n, maxThreads) : n;
+}
+
+inline
+ThreadPool::ThreadPool(size_t threads) {
+    threads = threads ? threads : threadCount();
+    for (size_t i = 0; i < threads; ++i)
+        queues_.emplace_back(new Queue);
+    for (size_t i = 0; i < threads; ++i)
+        workers_.emplace_back(&ThreadPool::work, this, i);
+}
+
+inline
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_all();
+    for (auto& w : workers_)
+        w.join();
+}
+
+/** The pool and queue of the worker running on this thread, if any */
+struct CurrentWorker {
+    const ThreadPool* pool;
+    size_t index;
+};
+
+inline
+CurrentWorker& currentWorker() {
+    static thread_local CurrentWorker current{nullptr, 0};
+    return current;
+}
+
+inline
+void ThreadPool::submit(Task task) {
+    // Count the task first, so a waking worker never misses it.
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++pending_;
+    }
+
+    auto& current = currentWorker();
+    auto index = current.pool == this ? current.index
+            : next_++ % queues_.size();
+    {
+        std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+    }
+    wake_.notify_one();
+}
+
+inline
+bool ThreadPool::pop(size_t index, Task& task) {
+    auto n = queues_.size();
+    for (size_t i = 0; i < n; ++i) {
+        auto& queue = *queues_[(index + i) % n];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty())
+            continue;
+
+        // Our own newest task is warmest in cache; steal others' oldest.
+        if (not i) {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        return true;
+    }
+    return false;
+}
+
+inline
+void ThreadPool::work(size_t index) {
+    currentWorker() = {this, index};
+    while (true) {
+        Task task;
+        if (pop(index, task)) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --pending_;
+            }
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (pending_) {
+            // A task is counted but not queued yet.
+            lock.unlock();
+            std::this_thread::yield();
+            continue;
+        }
+        if (stopping_)
+            return;
+        wake_.wait(lock, [this] () { return pending_ or stopping_; });
+    }
+}
+
+inline
+Executor& defaultExecutor() {
+    static ThreadPool pool;
+    return pool;
+}
+
+/** Call f(0), f(1), ... f(n - 1) in parallel on `executor`, or the default
+    executor if it's null, and return when they have all finished.  The
+    calling thread runs whichever calls no worker has picked up. */
+template <typename Function>
+void parallelFor(size_t n, Function f, Executor* executor = nullptr) {
+    struct State {
+        std::function<void(size_t)> f;
+        size_t n;
+        std::atomic<size_t> next{0};
+        size_t done = 0;
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        void run() {
+            size_t ran = 0;
+            for (size_t i; (i = next++) < n; ++ran)
+                f(i);
+            if (ran) {
+                std::lock_guard<std::mutex> lock(mutex);
+                done += ran;
+                if (done == n)
+                    finished.notify_all();
+            }
+        }
+    };
+
+    if (n < 2) {
+        if (n)
+            f(0);
+        return;
+    }
+
+    // Tasks may start after we return, so they share ownership of the state.
+    auto state = std::make_shared<State>();
+    state->f = f;
+    state->n = n;
+
+    auto& e = executor ? *executor : defaultExecutor();
+    for (size_t i = 1; i < n; ++i)
+        e.submit([state] () { state->run(); });
+
+    state->run();
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->finished.wait(lock, [&] () { return state->done == n; });
+}
+
+/** How many tasks to split work between on `executor`, or the default */
+inline
+size_t taskCount(Executor* executor, size_t maxTasks = 0) {
+    auto n = (executor ? *executor : defaultExecutor()).concurrency();
+    n = std::max<size_t>(n, 1);
+    return maxTasks ? std::min(n, maxTasks) : n;
+}
+
+template <typename RandomIt, typename Compare>
+void parallelSort(RandomIt begin, RandomIt end, Compare compare,
+                  Executor* executor = nullptr) {
+    static const size_t MIN_CHUNK = 0x4000;
+
+    size_t size = end - begin;
+    auto chunks = taskCount(executor, size / MIN_CHUNK + 1);
+    std::vector<RandomIt> bounds;
+    for (size_t i = 0; i <= chunks; ++i)
+        bounds.push_back(begin + size * i / chunks);
+
+    parallelFor(chunks, [&] (size_t i) {
+        std::sort(bounds[i], bounds[i + 1], compare);
+    }, executor);
+
+    for (size_t width = 1; width < chunks; width *= 2) {
+        parallelFor((chunks + 2 * width - 1) / (2 * width), [&] (size_t i) {
+            auto first = 2 * width * i;
+            auto middle = std::min(first + width, chunks);
+            auto last = std::min(first + 2 * width, chunks);
+            std::inplace_merge(bounds[first], bounds[middle], bounds[last],
+                               compare);
+        }, executor);
+    }
+}
+
+/** Flush a stream, returning false if any write to it has failed */
+inline
+bool flushed(FILE* file) {
+    return not fflush(file) and not ferror(file);
+}
+
+/** A source of lines for mergeLines: fills its argument and returns true,
+    or returns false when exhausted. */
+using LineSource = std::function<bool(std::string&)>;
+
+/** Merge sorted sources of lines into a writer, stably */
+template <Newline NL, typename Compare>
+size_t mergeLines(std::vector<LineSource>& sources, Writer& writer,
+                  Compare compare, bool unique = false) {
+    std::vector<std::string> heads(sources.size());
+
+    // A min-heap of source indices, ties broken by index to keep it stable.
+    auto after = [&] (size_t a, size_t b) {
+        return compare(heads[b], heads[a]) or
+            (a > b and not compare(heads[a], heads[b]));
+    };
+
+    std::vector<size_t> heap;
+    for (size_t i = 0; i < sources.size(); ++i) {
+        if (sources[i](heads[i]))
+            heap.push_back(i);
+    }
+    std::make_heap(heap.begin(), heap.end(), after);
+
+    auto lines = writer.lines<NL>();
+    size_t written = 0;
+    std::string last;
+    bool first = true;
+    while (not heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), after);
+        auto i = heap.back();
+        if (not unique) {
+            written += lines.writeOne(heads[i]);
+        } else if (first or compare(last, heads[i])) {
+            written += lines.writeOne(heads[i]);
+            last.swap(heads[i]);
+            first = false;
+        }
+
+        if (sources[i](heads[i]))
+            std::push_heap(heap.begin(), heap.end(), after);
+        else
+            heap.pop_back();
+    }
+    return written;
+}
+
+/** How many sorted runs to merge at once, leaving plenty of the limit on
+    open files for the rest of the program */
+inline
+size_t mergeFanIn() {
+    static const size_t MAX_FAN_IN = 256, MIN_FAN_IN = 4;
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) or limit.rlim_cur == RLIM_INFINITY)
+        return MAX_FAN_IN;
+    auto fanIn = static_cast<size_t>(limit.rlim_cur / 8);
+    return std::max(MIN_FAN_IN, std::min(MAX_FAN_IN, fanIn));
+}
+
+/** Read sorted runs in temporary files back through LineSources */
+template <Newline NL>
+std::vector<LineSource> runSources(
+        const std::vector<std::unique_ptr<Read>>& runs, size_t bufferSize) {
+    std::vector<LineSource> sources;
+    for (auto& r : runs) {
+        setvbuf(r->get(), nullptr, _IOFBF, bufferSize);
+        auto runLines = r->lines<NL>();
+        sources.push_back([runLines] (std::string& s) mutable {
+            return runLines.readOne(s);
+        });
+    }
+    return sources;
+}
+
+/** Merge sorted runs into one new temporary file, and close them */
+template <Newline NL, typename Compare>
+std::unique_ptr<Read> mergeRuns(std::vector<std::unique_ptr<Read>>& runs,
+                                Compare compare, size_t bufferSize) {
+    auto file = tmpfile();
+    if (not file) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error("tmpfile");
+#endif
+        return nullptr;
+    }
+
+    auto sources = runSources<NL>(runs, bufferSize);
+    Writer writer;
+    writer.set(file);
+    setvbuf(file, nullptr, _IOFBF, bufferSize);
+    mergeLines<NL>(sources, writer, compare);
+    runs.clear();
+    if (not flushed(file)) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error("tmpfile");
+#endif
+        return nullptr;
+    }
+    rewind(file);
+    return std::unique_ptr<Read>(new Read(writer.release()));
+}
+
+template <Newline NL, typename Compare>
+size_t sortLines(const char* in, const char* out,
+                 size_t memoryBudget, Compare compare, Executor* executor) {
+    static const size_t BUFFER_SIZE = 0x100000;
+
+    Reader reader(in);
+    if (not reader.get())
+        return 0;
+    setvbuf(reader.get(), nullptr, _IOFBF, BUFFER_SIZE);
+    auto lines = reader.lines<NL>();
+
+    // Spilled runs are kept in levels: once a level holds fanIn runs, they
+    // are merged into one run on the next level up, so at most fanIn - 1
+    // runs per level stay open.
+    auto fanIn = mergeFanIn();
+    auto bufferFor = [memoryBudget] (size_t sources) {
+        auto size = memoryBudget / 2 / sources;
+        return std::max<size_t>(std::min(size, BUFFER_SIZE), BUFSIZ);
+    };
+    std::vector<std::vector<std::unique_ptr<Read>>> levels;
+    auto addRun = [&] (std::unique_ptr<Read> run) {
+        for (size_t level = 0; run; ++level) {
+            if (levels.size() == level)
+                levels.emplace_back();
+            levels[level].push_back(std::move(run));
+            if (levels[level].size() < fanIn)
+                return true;
+            run = mergeRuns<NL>(levels[level], compare, bufferFor(fanIn));
+        }
+        return false;
+    };
+
+    // Each run is sorted and spilled on a background thread while the next
+    // one is read, so each of the two gets half the budget.  The thread
+    // mostly waits on I/O: the sorting itself runs on the executor.
+    std::unique_ptr<Read> spilled;
+    std::thread spiller;
+    bool spillFailed = false;
+    Lines run, spilling;
+    size_t used = 0;
+
+    // A run that couldn't be written in full fails the whole sort.
+    auto joinSpiller = [&] () {
+        spiller.join();
+        if (spillFailed) {
+#ifdef __cpp_exceptions
+            throw std::runtime_error("tmpfile");
+#endif
+            return false;
+        }
+        return addRun(std::move(spilled));
+    };
+
+    std::string line;
+    while (lines.readOne(line)) {
+        used += line.size() + sizeof(std::string);
+        run.push_back(std::move(line));
+        if (used < memoryBudget / 2)
+            continue;
+
+        if (spiller.joinable() and not joinSpiller())
+            return 0;
+        spilling.swap(run);
+        run.clear();
+        used = 0;
+
+        auto file = tmpfile();
+        if (not file) {
+#ifdef __cpp_exceptions
+            throw std::runtime_error("tmpfile");
+#endif
+            return 0;
+        }
+        spilled.reset(new Read(file));
+        spiller = std::thread([&spilling, &spillFailed, file, compare,
+                               executor] () {
+            setvbuf(file, nullptr, _IOFBF, BUFFER_SIZE);
+            parallelSort(spilling.begin(), spilling.end(), compare, executor);
+
+            Write writer(file);
+            writer.lines<NL>().write(spilling.begin(), spilling.end());
+            spillFailed = not flushed(file);
+            rewind(file);
+            writer.release();
+        });
+    }
+
+    if (spiller.joinable() and not joinSpiller())
+        return 0;
+    spilling.clear();
+    parallelSort(run.begin(), run.end(), compare, executor);
+
+    // Merge what's left of every level, and the last run straight from
+    // memory.
+    std::vector<std::unique_ptr<Read>> runs;
+    for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+        for (auto& r : *level)
+            runs.push_back(std::move(r));
+    }
+    auto sources = runSources<NL>(runs, bufferFor(runs.size() + 1));
+
+    auto next = run.begin();
+    auto end = run.end();
+    sources.push_back([&next, end] (std::string& s) {
+        if (next == end)
+            return false;
+        s.swap(*next++);
+        return true;
+    });
+
+    Writer writer(out);
+    if (not writer.get())
+        return 0;
+    setvbuf(writer.get(), nullptr, _IOFBF, BUFFER_SIZE);
+    auto written = mergeLines<NL>(sources, writer, compare);
+    if (not flushed(writer.get()) or writer.close()) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(out);
+#endif
+        return 0;
+    }
+    return written;
+}
+
+template <Newline NL, typename Compare>
+size_t mergeSorted(const std::vector<std::string>& inputs, const char* output,
+                   Compare compare, bool unique, size_t memoryBudget) {
+    static const size_t BUFFER_SIZE = 0x100000;
+
+    auto bufferSize = memoryBudget / (inputs.size() + 1);
+    bufferSize = std::max<size_t>(std::min(bufferSize, BUFFER_SIZE), BUFSIZ);
+
+    std::vector<std::unique_ptr<Reader>> readers;
+    std::vector<LineSource> sources;
+    for (auto& input : inputs) {
+        readers.emplace_back(new Reader(input.c_str()));
+        auto fp = readers.back()->get();
+        if (not fp)
+            return 0;
+        setvbuf(fp, nullptr, _IOFBF, bufferSize);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        auto lines = readers.back()->lines<NL>();
+        sources.push_back([lines] (std::string& s) mutable {
+            return lines.readOne(s);
+        });
+    }
+
+    Writer writer(output);
+    if (not writer.get())
+        return 0;
+    setvbuf(writer.get(), nullptr, _IOFBF, BUFFER_SIZE);
+    auto written = mergeLines<NL>(sources, writer, compare, unique);
+    if (not flushed(writer.get()) or writer.close()) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(output);
+#endif
+        return 0;
+    }
+    return written;
+}
+
+/** Return the first occurrence of a needle in [begin, end) or nullptr */
+inline
+const char* search(const char* begin, const char* end,
+                   const char* needle, size_t length) {
+    if (end - begin < static_cast<ptrdiff_t>(length) or not length)
+        return nullptr;
+#ifdef __GLIBC__
+    auto found = memmem(begin, end - begin, needle, length);
+    return static_cast<const char*>(found);
+#else
+    auto found = std::search(begin, end, needle, needle + length);
+    return found == end ? nullptr : found;
+#endif
+}
+
+/** Return the last occurrence of a needle in [begin, end) or nullptr */
+inline
+const char* searchLast(const char* begin, const char* end,
+                       const char* needle, size_t length) {
+    if (end - begin < static_cast<ptrdiff_t>(length) or not length)
+        return nullptr;
+#ifdef __GLIBC__
+    // Find the needle's last byte backwards, then check the bytes before it.
+    auto from = begin + length - 1;
+    while (from < end) {
+        auto p = static_cast<const char*>(
+            memrchr(from, needle[length - 1], end - from));
+        if (not p)
+            return nullptr;
+        if (not memcmp(p - (length - 1), needle, length - 1))
+            return p - (length - 1);
+        end = p;
+    }
+    return nullptr;
+#else
+    auto found = std::find_end(begin, end, needle, needle + length);
+    return found == end ? nullptr : found;
+#endif
+}
+
+/** Count the non-overlapping occurrences of a needle which start in
+    [begin, end) and finish before limit */
+inline
+size_t countOccurrences(const char* begin, const char* end, const char* limit,
+                        const char* needle, size_t length) {
+    if (length == 1)
+        return std::count(begin, end, *needle);
+
+    size_t count = 0;
+    auto stop = std::min(end + length - 1, limit);
+    for (auto p = begin; (p = search(p, stop, needle, length)); p += length)
+        ++count;
+    return count;
+}
+
+/** Call f(Match) for each match of `needle` starting in [begin, end) until
+    f returns false.  Line numbers are relative to `begin`.  Returns the
+    number of newlines that start in the part of [begin, end) scanned. */
+template <Newline NL, typename Function>
+size_t scanMatches(int fd, size_t begin, size_t end, const std::string& needle,
+                   bool countLines, Function f) {
+    static const size_t BLOCK_SIZE = 0x100000;
+    static const auto newline = newlineString<NL>();
+    static const auto newlineSize = strlen(newline);
+
+    // Blocks overlap so matches and newlines that straddle them are seen.
+    auto overlap = std::max(needle.size(), newlineSize) - 1;
+    std::vector<char> buffer(BLOCK_SIZE + overlap);
+    size_t lines = 0;
+
+    for (auto pos = begin; pos < end; pos += BLOCK_SIZE) {
+        auto bytes = readAt(fd, buffer.data(), buffer.size(), pos);
+        const char* data = buffer.data();
+        auto limit = data + bytes;
+        auto blockEnd = std::min(data + std::min(BLOCK_SIZE, end - pos), limit);
+        auto searchEnd = std::min(blockEnd + needle.size() - 1, limit);
+
+        auto counted = data;
+        auto p = data;
+        while ((p = search(p, searchEnd, needle.data(), needle.size()))) {
+            if (countLines) {
+                lines += countOccurrences(
+                    counted, p, limit, newline, newlineSize);
+                counted = p;
+            }
+            if (not f(Match{pos + (p - data), lines}))
+                return lines;
+            ++p;
+        }
+
+        if (countLines)
+            lines += countOccurrences(
+                counted, blockEnd, limit, newline, newlineSize);
+        if (blockEnd < data + BLOCK_SIZE)
+            break;
+    }
+    return lines;
+}
+
+/** How many tasks to search a file of a given size with */
+inline
+size_t searchThreads(size_t threads, size_t size, Executor* executor) {
+    static const size_t MIN_BYTES_PER_THREAD = 0x100000;
+    threads = threads ? threads : taskCount(executor);
+    return std::max<size_t>(1, std::min(threads, size / MIN_BYTES_PER_THREAD));
+}
+
+template <Newline NL>
+Match find(const char* filename, const std::string& needle) {
+    Reader reader(filename);
+    auto fd = fileno(reader.get());
+
+    Match match{std::string::npos, 0};
+    scanMatches<NL>(fd, 0, fileSize(fd), needle, true, [&] (Match m) {
+        match = m;
+        return false;
+    });
+    return match;
+}
+
+template <Newline NL>
+std::vector<Match> findAll(const char* filename, const std::string& needle,
+                           size_t threads, Executor* executor) {
+    Reader reader(filename);
+    auto fd = fileno(reader.get());
+    auto size = fileSize(fd);
+    auto n = searchThreads(threads, size, executor);
+
+    std::vector<std::vector<Match>> matches(n);
+    std::vector<size_t> lines(n);
+    parallelFor(n, [&] (size_t i) {
+        auto begin = size * i / n, end = size * (i + 1) / n;
+        lines[i] = scanMatches<NL>(fd, begin, end, needle, true, [&] (Match m) {
+            matches[i].push_back(m);
+            return true;
+        });
+    }, executor);
+
+    std::vector<Match> result;
+    size_t lineBase = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (auto& m : matches[i])
+            result.push_back({m.offset, m.line + lineBase});
+        lineBase += lines[i];
+    }
+    return result;
+}
+
+inline
+size_t countMatches(const char* filename, const std::string& needle,
+                    size_t threads, Executor* executor) {
+    Reader reader(filename);
+    auto fd = fileno(reader.get());
+    auto size = fileSize(fd);
+    auto n = searchThreads(threads, size, executor);
+
+    std::vector<size_t> counts(n);
+    parallelFor(n, [&] (size_t i) {
+        auto begin = size * i / n, end = size * (i + 1) / n;
+        scanMatches<Newline::system>(
+            fd, begin, end, needle, false, [&] (Match) {
+                ++counts[i];
+                return true;
+            });
+    }, executor);
+
+    size_t count = 0;
+    for (auto c : counts)
+        count += c;
+    return count;
+}
+
+/** Return the offset of the first line that starts at or after `offset`,
+    using `buffer` as scratch space */
+template <Newline NL>
+size_t nextLineStart(int fd, size_t offset, std::vector<char>& buffer) {
+    static const size_t MIN_BLOCK_SIZE = 0x200;
+    static const size_t MAX_BLOCK_SIZE = 0x10000;
+    static const auto newline = newlineString<NL>();
+    static const auto len = strlen(newline);
+
+    if (not offset)
+        return 0;
+
+    // A newline that ends just before `offset` starts at `offset - len`.
+    // Most lines are short, so start with a small read and grow it.
+    auto block = MIN_BLOCK_SIZE;
+    auto pos = offset > len ? offset - len : 0;
+    while (true) {
+        buffer.resize(block);
+        const char* data = buffer.data();
+        auto bytes = readAt(fd, buffer.data(), block, pos);
+        if (auto found = search(data, data + bytes, newline, len))
+            return pos + (found - data) + len;
+        if (bytes < block)
+            return pos + bytes;
+        pos += block - (len - 1);
+        block = std::min(2 * block, MAX_BLOCK_SIZE);
+    }
+}
+
+/** Return the offset of the first line that starts at or after `offset` */
+template <Newline NL>
+size_t nextLineStart(int fd, size_t offset) {
+    std::vector<char> buffer;
+    return nextLineStart<NL>(fd, offset, buffer);
+}
+
+/** Copy `length` bytes at `offset` in one file to the current position of
+    another, without going through user space where the kernel allows */
+inline
+size_t copyRange(int in, size_t offset, size_t length, int out) {
+    size_t copied = 0;
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    while (copied < length) {
+        loff_t from = offset + copied;
+        auto bytes = copy_file_range(in, &from, out, nullptr,
+                                     length - copied, 0);
+        if (bytes <= 0)
+            break;
+        copied += bytes;
+    }
+#endif
+
+    // Fall back to copying through a buffer.
+    static const size_t BUFFER_SIZE = 0x100000;
+    std::vector<char> buffer;
+    while (copied < length) {
+        buffer.resize(BUFFER_SIZE);
+        auto wanted = std::min(BUFFER_SIZE, length - copied);
+        auto bytes = readAt(in, buffer.data(), wanted, offset + copied);
+        if (not bytes or writeAll(out, buffer.data(), bytes) != bytes)
+            break;
+        copied += bytes;
+    }
+    return copied;
+}
+
+/** Split a file at the first line boundary after each of `offsets` */
+template <Newline NL>
+std::vector<std::string> splitAt(const char* filename,
+                                 const std::vector<size_t>& offsets,
+                                 Executor* executor) {
+    Reader reader(filename);
+    auto fd = fileno(reader.get());
+    auto size = fileSize(fd);
+
+    std::vector<char> buffer;
+    std::vector<size_t> cuts{0};
+    for (auto offset : offsets) {
+        auto cut = nextLineStart<NL>(fd, offset, buffer);
+        cuts.push_back(std::min(cut, size));
+    }
+    cuts.push_back(size);
+
+    auto shards = cuts.size() - 1;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < shards; ++i)
+        names.push_back(filename + ("." + std::to_string(i)));
+
+    std::atomic<bool> failed{false};
+    auto threads = taskCount(executor, shards);
+    parallelFor(threads, [&] (size_t t) {
+        for (auto i = t; i < shards; i += threads) {
+            auto flags = O_WRONLY | O_CREAT | O_TRUNC;
+            auto out = open(names[i].c_str(), flags, 0666);
+            auto length = cuts[i + 1] - cuts[i];
+            if (out < 0 or copyRange(fd, cuts[i], length, out) != length)
+                failed = true;
+            if (out >= 0 and ::close(out))
+                failed = true;
+        }
+    }, executor);
+
+    if (failed) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+    }
+    return names;
+}
+
+template <Newline NL>
+std::vector<std::string> split(const char* filename, size_t shards,
+                               Executor* executor) {
+    auto size = tfile::size(filename);
+    std::vector<size_t> offsets;
+    for (size_t i = 1; i < shards; ++i)
+        offsets.push_back(size * i / shards);
+    return splitAt<NL>(filename, offsets, executor);
+}
+
+template <Newline NL>
+std::vector<std::string> splitBytes(const char* filename, size_t shardBytes,
+                                    Executor* executor) {
+    auto size = tfile::size(filename);
+    std::vector<size_t> offsets;
+    for (auto offset = shardBytes; shardBytes and offset < size;
+         offset += shardBytes) {
+        offsets.push_back(offset);
+    }
+    return splitAt<NL>(filename, offsets, executor);
+}
+
+inline
+MappedWriter::MappedWriter(const char* filename)
+        : fd_(open(filename, O_RDWR | O_CREAT | O_TRUNC, 0666)) {
+#ifdef __cpp_exceptions
+    if (fd_ < 0)
+        throw std::runtime_error(filename);
+#endif
+}
+
+inline
+MappedWriter::MappedWriter(MappedWriter&& other) noexcept
+        : fd_(other.fd_), data_(other.data_),
+          size_(other.size_), capacity_(other.capacity_) {
+    other.fd_ = -1;
+    other.data_ = nullptr;
+    other.size_ = other.capacity_ = 0;
+}
+
+inline
+MappedWriter& MappedWriter::operator=(MappedWriter&& other) {
+    if (this != &other) {
+        close();
+        std::swap(fd_, other.fd_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        std::swap(capacity_, other.capacity_);
+    }
+    return *this;
+}
+
+inline
+bool MappedWriter::reserve(size_t capacity) {
+    static const size_t MIN_GROWTH = 0x100000;
+
+    if (capacity <= capacity_)
+        return true;
+    if (fd_ < 0)
+        return false;
+
+    // Grow geometrically, in whole pages.
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    capacity = std::max(capacity, std::max(2 * capacity_, MIN_GROWTH));
+    capacity = (capacity + page - 1) / page * page;
+
+    if (posix_fallocate(fd_, capacity_, capacity - capacity_)) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error("posix_fallocate");
+#endif
+        return false;
+    }
+
+    void* data;
+    auto prot = PROT_READ | PROT_WRITE;
+    if (not data_) {
+        data = mmap(nullptr, capacity, prot, MAP_SHARED, fd_, 0);
+    } else {
+#ifdef __linux__
+        data = mremap(data_, capacity_, capacity, MREMAP_MAYMOVE);
+#else
+        munmap(data_, capacity_);
+        data_ = nullptr;
+        data = mmap(nullptr, capacity, prot, MAP_SHARED, fd_, 0);
+#endif
+    }
+
+    if (data == MAP_FAILED) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error("mmap");
+#endif
+        return false;
+    }
+    data_ = static_cast<char*>(data);
+    capacity_ = capacity;
+    return true;
+}
+
+inline
+char* MappedWriter::append(size_t length) {
+    auto size = size_;
+    return resize(size + length) ? data_ + size : nullptr;
+}
+
+inline
+bool MappedWriter::resize(size_t size) {
+    if (not reserve(size))
+        return false;
+    if (size < size_)
+        memset(data_ + size, 0, size_ - size);
+    size_ = size;
+    return true;
+}
+
+inline
+size_t MappedWriter::write(const char* data, size_t length) {
+    auto p = append(length);
+    if (not p)
+        return 0;
+    memcpy(p, data, length);
+    return length;
+}
+
+inline
+size_t MappedWriter::write(const std::string& s) {
+    return write(s.data(), s.size());
+}
+
+inline
+int MappedWriter::close() {
+    if (fd_ < 0)
+        return 0;
+
+    int result = 0;
+    if (data_ and munmap(data_, capacity_))
+        result = -1;
+    if (ftruncate(fd_, size_))
+        result = -1;
+    if (::close(fd_))
+        result = -1;
+
+    fd_ = -1;
+    data_ = nullptr;
+    size_ = capacity_ = 0;
+    return result;
+}
+
+/** Call f(name) for each entry in the directory holding `filename` whose
+    name starts with the base name of `filename` followed by a '.', passing
+    the rest of the name */
+template <typename Function>
+void forEachSuffix(const std::string& filename, Function f) {
+    auto slash = filename.rfind('/');
+    auto dir = slash == std::string::npos ? std::string(".")
+            : filename.substr(0, slash ? slash : 1);
+    auto prefix = filename.substr(slash + 1) + ".";
+
+    auto d = opendir(dir.c_str());
+    if (not d)
+        return;
+    while (auto entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (not name.compare(0, prefix.size(), prefix))
+            f(name.substr(prefix.size()));
+    }
+    closedir(d);
+}
+
+inline
+RotatingAppender::RotatingAppender(
+    const char* filename, size_t maxBytes, std::chrono::seconds maxAge,
+    size_t keep, Callback onRotate)
+        : filename_(filename), maxBytes_(maxBytes), maxAge_(maxAge),
+          keep_(keep), onRotate_(onRotate) {
+    // Carry on numbering after the newest existing segment.
+    forEachSuffix(filename_, [this] (const std::string& suffix) {
+        auto digits = std::min(suffix.find('.'), suffix.size());
+        if (digits and suffix.find_first_not_of("0123456789") >= digits)
+            newest_ = std::max<size_t>(newest_, std::stoull(suffix));
+    });
+    open();
+}
+
+inline
+RotatingAppender::~RotatingAppender() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    queued_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+}
+
+inline
+void RotatingAppender::open() {
+    file_.set(fopen(filename_.c_str(), "a"));
+    if (not file_.get()) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename_);
+#endif
+        return;
+    }
+    bytes_ = fileSize(fileno(file_.get()));
+    deadline_ = std::chrono::steady_clock::now() + maxAge_;
+}
+
+inline
+std::string RotatingAppender::segment(size_t number) const {
+    return filename_ + "." + std::to_string(number);
+}
+
+inline
+bool RotatingAppender::rotate() {
+    // The file is moved aside before it's closed, so if that fails it can
+    // still be written to.
+    auto number = newest_ + 1;
+    auto moved = keep_ ? rename(filename_.c_str(), segment(number).c_str())
+            : remove(filename_.c_str());
+    if (moved) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename_);
+#endif
+        return false;
+    }
+    open();
+    if (not keep_)
+        return true;
+
+    newest_ = number;
+    if (not onRotate_) {
+        prune(number);
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(number);
+        if (not worker_.joinable())
+            worker_ = std::thread(&RotatingAppender::work, this);
+    }
+    queued_.notify_one();
+    return true;
+}
+
+/** Delete the segment that `newest` pushes out of the kept ones, and any
+    files made from it */
+inline
+void RotatingAppender::prune(size_t newest) {
+    if (newest <= keep_)
+        return;
+    auto old = std::to_string(newest - keep_);
+    forEachSuffix(filename_, [&] (const std::string& suffix) {
+        if (not suffix.compare(0, old.size(), old) and
+            (suffix.size() == old.size() or suffix[old.size()] == '.')) {
+            remove((filename_ + "." + suffix).c_str());
+        }
+    });
+}
+
+inline
+void RotatingAppender::work() {
+    while (true) {
+        size_t number;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            queued_.wait(lock, [this] () {
+                return stopping_ or not queue_.empty();
+            });
+            if (queue_.empty())
+                return;
+            number = queue_.front();
+            queue_.pop_front();
+        }
+
+        // Prune only after the callback, so whatever it made is pruned too.
+        onRotate_(segment(number));
+        prune(number);
+    }
+}
+
+inline
+void RotatingAppender::rotateIfNeeded(size_t length) {
+    if (bytes_ and bytes_ + length > maxBytes_)
+        rotate();
+    else if (maxAge_.count() and std::chrono::steady_clock::now() >= deadline_)
+        rotate();
+}
+
+inline
+size_t RotatingAppender::write(const char* data, size_t length) {
+    rotateIfNeeded(length);
+    auto written = file_.get() ? file_.write(data, length) : 0;
+    bytes_ += written;
+    return written;
+}
+
+template <Newline NL>
+size_t RotatingAppender::writeLine(const std::string& s) {
+    static const auto newline = newlineString<NL>();
+    static const auto len = strlen(newline);
+
+    rotateIfNeeded(s.size() + len);
+    size_t written = 0;
+    if (file_.get())
+        written = file_.write(s) + file_.write(newline, len);
+    bytes_ += written;
+    return written;
+}
+
+inline
+size_t RotatingAppender::write(const char* data) {
+    return write(data, strlen(data));
+}
+
+inline
+size_t RotatingAppender::write(const std::string& s) {
+    return write(s.data(), s.size());
+}
+
+inline
+SharedAppender::SharedAppender(const char* filename)
+        : fd_(open(filename, O_WRONLY | O_CREAT | O_APPEND, 0666)) {
+#ifdef __cpp_exceptions
+    if (fd_ < 0)
+        throw std::runtime_error(filename);
+#endif
+}
+
+inline
+int SharedAppender::close() {
+    auto result = fd_ < 0 ? 0 : ::close(fd_);
+    fd_ = -1;
+    return result;
+}
+
+inline
+std::string& SharedAppender::buffer() {
+    static thread_local std::string buffer;
+    buffer.clear();
+    return buffer;
+}
+
+inline
+size_t SharedAppender::write(const char* data, size_t length) {
+    // Only a full disk or a signal could split a record into two writes.
+    return writeAll(fd_, data, length);
+}
+
+inline
+size_t SharedAppender::write(const std::string& s) {
+    return write(s.data(), s.size());
+}
+
+template <Newline NL>
+size_t SharedAppender::writeLine(const std::string& line) {
+    auto& b = buffer();
+    b += line;
+    b += newlineString<NL>();
+    return write(b);
+}
+
+template <Newline NL, typename Container>
+size_t SharedAppender::writeLines(const Container& lines) {
+    auto& b = buffer();
+    for (auto& line : lines) {
+        b += line;
+        b += newlineString<NL>();
+    }
+    return write(b);
+}
+
+inline
+streambuf::streambuf(FILE* file, std::ios_base::openmode mode,
+                     size_t bufferSize)
+        : file_(file), fd_(file ? fileno(file) : -1),
+          output_(mode & std::ios_base::out),
+          buffer_(std::max<size_t>(bufferSize, 1)) {
+    // Move the descriptor to where the FILE* logically is.
+    if (file_) {
+        fflush(file_);
+        lseek(fd_, ftello(file_), SEEK_SET);
+    }
+
+    auto b = buffer_.data();
+    if (output_)
+        setp(b, b + buffer_.size());
+    else
+        setg(b, b, b);
+}
+
+inline
+streambuf::streambuf(Reader& r, size_t bufferSize)
+        : streambuf(r.get(), std::ios_base::in, bufferSize) {
+}
+
+inline
+streambuf::streambuf(Writer& w, size_t bufferSize)
+        : streambuf(w.get(), std::ios_base::out, bufferSize) {
+}
+
+inline
+streambuf::streambuf(Appender& a, size_t bufferSize)
+        : streambuf(a.get(), std::ios_base::out, bufferSize) {
+}
+
+inline
+streambuf::~streambuf() {
+    if (file_) {
+        sync();
+        fseeko(file_, lseek(fd_, 0, SEEK_CUR), SEEK_SET);
+    }
+}
+
+inline
+ssize_t streambuf::readSome(char* data, size_t length) {
+    ssize_t bytes;
+    do {
+        bytes = ::read(fd_, data, length);
+    } while (bytes < 0 and errno == EINTR);
+    return bytes;
+}
+
+inline
+bool streambuf::flushBuffer() {
+    if (not output_)
+        return true;
+
+    size_t length = pptr() - pbase();
+    if (writeAll(fd_, pbase(), length) != length)
+        return false;
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    return true;
+}
+
+inline
+streambuf::int_type streambuf::underflow() {
+    if (output_)
+        return traits_type::eof();
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+
+    auto b = buffer_.data();
+    auto bytes = readSome(b, buffer_.size());
+    if (bytes <= 0)
+        return traits_type::eof();
+    setg(b, b, b + bytes);
+    return traits_type::to_int_type(*b);
+}
+
+inline
+streambuf::int_type streambuf::overflow(int_type ch) {
+    if (not output_ or not flushBuffer())
+        return traits_type::eof();
+    if (not traits_type::eq_int_type(ch, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(ch);
+        pbump(1);
+    }
+    return traits_type::not_eof(ch);
+}
+
+inline
+int streambuf::sync() {
+    if (output_)
+        return flushBuffer() ? 0 : -1;
+
+    // Give back whatever was read ahead but not consumed.
+    if (auto unread = egptr() - gptr())
+        lseek(fd_, -unread, SEEK_CUR);
+    setg(buffer_.data(), buffer_.data(), buffer_.data());
+    return 0;
+}
+
+inline
+streambuf::pos_type streambuf::seekoff(
+        off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode) {
+    static const pos_type FAILED = pos_type(off_type(-1));
+
+    auto here = lseek(fd_, 0, SEEK_CUR);
+    if (here < 0)
+        return FAILED;
+
+    // Telling needn't touch the buffer.
+    auto buffered = output_ ? pptr() - pbase() : gptr() - egptr();
+    if (dir == std::ios_base::cur and not offset)
+        return pos_type(here + buffered);
+
+    if (sync())
+        return FAILED;
+    auto whence = dir == std::ios_base::beg ? SEEK_SET
+            : dir == std::ios_base::cur ? SEEK_CUR : SEEK_END;
+    auto result = lseek(fd_, offset, whence);
+    return result < 0 ? FAILED : pos_type(result);
+}
+
+inline
+streambuf::pos_type streambuf::seekpos(
+        pos_type position, std::ios_base::openmode which) {
+    return seekoff(off_type(position), std::ios_base::beg, which);
+}
+
+inline
+std::streamsize streambuf::xsgetn(char* data, std::streamsize length) {
+    if (output_)
+        return 0;
+
+    std::streamsize total = std::min<std::streamsize>(egptr() - gptr(), length);
+    memcpy(data, gptr(), total);
+    gbump(total);
+
+    // Large reads go straight into the caller's memory.
+    while (total < length) {
+        auto wanted = length - total;
+        if (wanted < static_cast<std::streamsize>(buffer_.size())) {
+            if (traits_type::eq_int_type(underflow(), traits_type::eof()))
+                break;
+            auto bytes = std::min<std::streamsize>(egptr() - gptr(), wanted);
+            memcpy(data + total, gptr(), bytes);
+            gbump(bytes);
+            total += bytes;
+        } else {
+            auto bytes = readSome(data + total, wanted);
+            if (bytes <= 0)
+                break;
+            total += bytes;
+        }
+    }
+    return total;
+}
+
+inline
+std::streamsize streambuf::xsputn(const char* data, std::streamsize length) {
+    if (not output_)
+        return 0;
+
+    if (length < epptr() - pptr()) {
+        memcpy(pptr(), data, length);
+        pbump(length);
+        return length;
+    }
+
+    // Large writes go straight from the caller's memory.
+    if (not flushBuffer())
+        return 0;
+    return writeAll(fd_, data, length);
+}
+
+inline
+Newline detectNewline(const char* filename) {
+    static const size_t BLOCK_SIZE = 0x10000;
+
+    Reader reader(filename);
+    std::string block = reader.read(BLOCK_SIZE);
+
+    size_t lf = 0, crlf = 0, cr = 0;
+    for (size_t i = 0; i < block.size(); ++i) {
+        auto next = i + 1 < block.size() ? block[i + 1] : '\0';
+        if (block[i] == '\n')
+            ++(i and block[i - 1] == '\r' ? crlf : lf);
+        else if (block[i] == '\r' and next and next != '\n')
+            ++cr;
+    }
+
+    if (not (lf or crlf or cr))
+        return Newline::system;
+    if (crlf >= lf and crlf >= cr)
+        return Newline::cr_lf;
+    return lf >= cr ? Newline::lf : Newline::cr;
+}
+
+/** Read all of file `in` in blocks, replace each `from` with `to`, and pass
+    the results to `output(data, length)`, which returns the bytes written.
+    Sets `written` to the bytes output, and returns false if an output
+    fell short. */
+template <typename Output>
+bool convertBlocks(int in, const char* from, const char* to, Output output,
+                   size_t& written) {
+    static const size_t BLOCK_SIZE = 0x100000;
+
+    auto fromSize = strlen(from), toSize = strlen(to);
+    std::vector<char> input(BLOCK_SIZE + fromSize), result;
+    size_t carry = 0, offset = 0;
+    written = 0;
+
+    while (true) {
+        auto data = input.data();
+        auto bytes = readAt(in, data + carry, BLOCK_SIZE, offset);
+        offset += bytes;
+        auto end = data + carry + bytes;
+
+        // Unless this is the end, hold back a tail that might start a newline
+        // which finishes in the next block.
+        auto stop = end;
+        if (bytes)
+            stop = end - std::min<size_t>(fromSize - 1, end - data);
+
+        result.clear();
+        const char* p = data;
+        while (auto found = search(p, end, from, fromSize)) {
+            result.insert(result.end(), p, found);
+            result.insert(result.end(), to, to + toSize);
+            p = found + fromSize;
+        }
+
+        auto keep = std::max<const char*>(p, stop);
+        result.insert(result.end(), p, keep);
+        if (output(result.data(), result.size()) != result.size())
+            return false;
+        written += result.size();
+
+        carry = end - keep;
+        memmove(data, keep, carry);
+        if (not bytes)
+            return true;
+    }
+}
+
+inline
+size_t convertNewlines(const char* in, const char* out, Newline from,
+                       Newline to) {
+    Reader reader(in);
+    auto fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(out);
+#endif
+        return 0;
+    }
+
+    size_t written;
+    auto converted = convertBlocks(
+        fileno(reader.get()), newlineString(from), newlineString(to),
+        [=] (const char* data, size_t length) {
+            return writeAll(fd, data, length);
+        }, written);
+    if (::close(fd) or not converted) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(out);
+#endif
+        return 0;
+    }
+    return written;
+}
+
+inline
+size_t convertNewlines(const char* in, const char* out, Newline to) {
+    return convertNewlines(in, out, detectNewline(in), to);
+}
+
+inline
+size_t convertNewlines(const char* filename, Newline from, Newline to) {
+    auto fromString = newlineString(from), toString = newlineString(to);
+    if (strlen(toString) > strlen(fromString)) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error("Newline too long to convert in place");
+#endif
+        return 0;
+    }
+
+    // The output never gets ahead of the input, so it can overwrite it.
+    ReaderWriter file(filename);
+    auto fd = fileno(file.get());
+    size_t offset = 0, written;
+    auto converted = convertBlocks(
+        fd, fromString, toString, [&] (const char* data, size_t length) {
+            auto bytes = writeAt(fd, data, length, offset);
+            offset += bytes;
+            return bytes;
+        }, written);
+
+    // After a failed write, the rest of the input is still in the file
+    // past the output, so truncating would lose it.
+    if (not converted or ftruncate(fd, written)) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+        return 0;
+    }
+    return written;
+}
+
+inline
+ConcatReader::ConcatReader(const std::vector<std::string>& filenames)
+        : filenames_(filenames), starts_{0} {
+    for (auto& f : filenames_) {
+        struct stat st;
+        auto size = stat(f.c_str(), &st) ? 0 : st.st_size;
+        starts_.push_back(starts_.back() + size);
+    }
+    open(0);
+}
+
+inline
+bool ConcatReader::open(size_t index) {
+    if (index >= filenames_.size()) {
+        current_.close();
+        index_ = filenames_.size();
+        return false;
+    }
+
+    auto openFile = [&] (size_t i) {
+        auto fp = fopen(filenames_[i].c_str(), "r");
+#ifdef __cpp_exceptions
+        if (not fp)
+            throw std::runtime_error(filenames_[i]);
+#endif
+        return fp;
+    };
+
+    // Use the prefetched file if it's the right one.
+    if (index == index_ + 1 and next_.get()) {
+        current_.set(next_.release());
+        rewind(current_.get());
+    } else {
+        next_.close();
+        current_.set(openFile(index));
+    }
+    index_ = index;
+
+    if (index + 1 < filenames_.size()) {
+        next_.set(openFile(index + 1));
+#ifdef POSIX_FADV_WILLNEED
+        if (next_.get())
+            posix_fadvise(fileno(next_.get()), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    }
+    return current_.get();
+}
+
+inline
+size_t ConcatReader::read(char* data, size_t length) {
+    size_t total = 0;
+    while (total < length and current_.get()) {
+        auto bytes = current_.read(data + total, length - total);
+        total += bytes;
+        if (total < length and not advance())
+            break;
+    }
+    return total;
+}
+
+inline
+size_t ConcatReader::readUntil(std::string& s, char delimiter,
+                               size_t maxLength) {
+    size_t total = 0;
+    while (total < maxLength and current_.get()) {
+        auto bytes = current_.readUntil(s, delimiter, maxLength - total);
+        total += bytes;
+        if (bytes and s.back() == delimiter)
+            break;
+        if (total < maxLength and not advance())
+            break;
+    }
+    return total;
+}
+
+inline
+off_t ConcatReader::tell() {
+    if (not current_.get())
+        return size();
+    return starts_[index_] + ftello(current_.get());
+}
+
+inline
+int ConcatReader::seek(off_t offset, int whence) {
+    if (whence == SEEK_CUR)
+        offset += tell();
+    else if (whence == SEEK_END)
+        offset += size();
+    if (offset < 0)
+        return -1;
+
+    // Find the last file that starts at or before the offset.
+    auto position = static_cast<size_t>(offset);
+    auto i = std::upper_bound(starts_.begin(), starts_.end() - 1, position);
+    size_t index = (i - starts_.begin()) - 1;
+    if ((index != index_ or not current_.get()) and not open(index))
+        return -1;
+    return current_.seek(position - starts_[index]);
+}
+
+template <Newline NL>
+LineReader<NL, ConcatReader> ConcatReader::lines(size_t begin, size_t end) {
+    LineReader<NL, ConcatReader> reader(*this);
+    reader.range(begin, end);
+    return reader;
+}
+
+/** Return the start of the line containing `offset`, using `buffer` as
+    scratch space */
+template <Newline NL>
+size_t lineStart(int fd, size_t offset, std::vector<char>& buffer) {
+    static const size_t MIN_BLOCK_SIZE = 0x200;
+    static const size_t MAX_BLOCK_SIZE = 0x10000;
+    static const auto newline = newlineString<NL>();
+    static const auto len = strlen(newline);
+
+    // Look backwards for the last newline that ends at or before `offset`.
+    // Most lines are short, so start with a small read and grow it.
+    auto block = MIN_BLOCK_SIZE;
+    auto end = offset;
+    while (end) {
+        auto begin = end > block ? end - block : 0;
+        buffer.resize(end - begin);
+        const char* data = buffer.data();
+        auto bytes = readAt(fd, buffer.data(), end - begin, begin);
+        if (auto last = searchLast(data, data + bytes, newline, len))
+            return begin + (last - data) + len;
+        if (not begin)
+            break;
+        end = begin + len - 1;
+        block = std::min(2 * block, MAX_BLOCK_SIZE);
+    }
+    return 0;
+}
+
+/** Return the start of the line containing `offset` */
+template <Newline NL>
+size_t lineStart(int fd, size_t offset) {
+    std::vector<char> buffer;
+    return lineStart<NL>(fd, offset, buffer);
+}
+
+template <Newline NL>
+Lines sampleApproximate(const char* filename, size_t k, uint64_t seed) {
+    static const auto len = strlen(newlineString<NL>());
+
+    Reader reader(filename);
+    auto fd = fileno(reader.get());
+    auto size = fileSize(fd);
+
+    std::mt19937_64 random(seed);
+    std::uniform_int_distribution<size_t> offsets(0, size ? size - 1 : 0);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    Lines result;
+    std::vector<char> buffer;
+    std::set<size_t> chosen;
+    auto shortest = std::numeric_limits<size_t>::max();
+    auto maxTries = 64 * k + 1024;
+    for (size_t t = 0; size and result.size() < k and t < maxTries; ++t) {
+        auto offset = offsets(random);
+        auto begin = lineStart<NL>(fd, offset, buffer);
+        auto end = nextLineStart<NL>(fd, offset + 1, buffer);
+        auto length = end - begin;
+
+        shortest = std::min(shortest, length);
+        if (uniform(random) * length >= shortest or chosen.count(begin))
+            continue;
+
+        chosen.insert(begin);
+        std::string line(length, '\0');
+        line.resize(readAt(fd, &line[0], length, begin));
+        if (line.size() >= len and
+            not line.compare(line.size() - len, len, newlineString<NL>())) {
+            line.resize(line.size() - len);
+        }
+        result.push_back(std::move(line));
+    }
+    return result;
+}
+
+template <Newline NL>
+Lines sampleExact(const char* filename, size_t k, uint64_t seed) {
+    std::mt19937_64 random(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    auto draw = [&] () { return 1.0 - uniform(random); };  // In (0, 1]
+
+    Reader reader(filename);
+    auto lines = reader.lines<NL>();
+    Lines result;
+    std::string line;
+    while (result.size() < k and lines.readOne(line))
+        result.push_back(line);
+    if (result.size() < k)
+        return result;
+
+    // Algorithm L: compute how many lines to skip before each replacement.
+    auto weight = exp(log(draw()) / k);
+    auto skip = [&] () {
+        return static_cast<size_t>(floor(log(draw()) / log(1 - weight)));
+    };
+
+    size_t next = k + skip();
+    for (auto i = k; lines.readOne(line); ++i) {
+        if (i == next) {
+            std::uniform_int_distribution<size_t> index(0, k - 1);
+            result[index(random)].swap(line);
+            weight *= exp(log(draw()) / k);
+            next += skip() + 1;
+        }
+    }
+    return result;
+}
+
+template <Newline NL>
+Lines sampleLines(const char* filename, size_t k, uint64_t seed,
+                  Sampling sampling) {
+    if (not k)
+        return {};
+    if (sampling == Sampling::exact)
+        return sampleExact<NL>(filename, k, seed);
+    return sampleApproximate<NL>(filename, k, seed);
+}
+
+/** Read the line starting at `offset` without its newline, and return the
+    offset of the line after it */
+template <Newline NL>
+size_t readLineAt(int fd, size_t offset, std::string& line) {
+    static const size_t BLOCK_SIZE = 0x1000;
+    static const auto newline = newlineString<NL>();
+    static const auto len = strlen(newline);
+
+    line.clear();
+    size_t searched = 0;
+    while (true) {
+        auto size = line.size();
+        line.resize(size + BLOCK_SIZE);
+        auto bytes = readAt(fd, &line[size], BLOCK_SIZE, offset + size);
+        line.resize(size + bytes);
+
+        auto from = searched > len ? searched - len + 1 : 0;
+        auto found = line.find(newline, from);
+        if (found != std::string::npos) {
+            line.resize(found);
+            return offset + found + len;
+        }
+        if (not bytes)
+            return offset + line.size();
+        searched = line.size();
+    }
+}
+
+/** Return the first line start at or after `begin` whose key isn't less
+    than `key`, or the size of the file, using `buffer` and `line` as
+    scratch space */
+template <Newline NL, typename KeyFunction, typename Compare>
+size_t lowerBound(int fd, size_t begin, size_t size, const std::string& key,
+                  KeyFunction& keyOf, Compare& compare,
+                  std::vector<char>& buffer, std::string& line) {
+    auto answer = size;
+    auto lo = begin, hi = size;
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        auto start = nextLineStart<NL>(fd, mid, buffer);
+        if (start >= hi) {
+            hi = mid;  // No line starts in [mid, hi).
+            continue;
+        }
+
+        auto end = readLineAt<NL>(fd, start, line);
+        if (compare(keyOf(line), key)) {
+            lo = end;
+        } else {
+            answer = start;
+            hi = start;
+        }
+    }
+    return answer;
+}
+
+template <Newline NL, typename KeyFunction, typename Compare>
+bool lookupSorted(const char* filename, const std::string& key,
+                  std::string& line, KeyFunction keyOf, Compare compare) {
+    auto results = lookupSorted<NL>(filename, std::vector<std::string>{key},
+                                    keyOf, compare);
+    if (results[0].found)
+        line.swap(results[0].line);
+    return results[0].found;
+}
+
+template <Newline NL, typename KeyFunction, typename Compare>
+std::vector<Lookup> lookupSorted(const char* filename,
+                                 const std::vector<std::string>& keys,
+                                 KeyFunction keyOf, Compare compare) {
+    Reader reader(filename);
+    auto fd = fileno(reader.get());
+    auto size = fileSize(fd);
+
+    std::vector<size_t> order(keys.size());
+    for (size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+    std::sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+        return compare(keys[a], keys[b]);
+    });
+
+    std::vector<Lookup> results(keys.size());
+    std::vector<char> buffer;
+    std::string line;
+    size_t begin = 0;
+    for (auto i : order) {
+        auto& key = keys[i];
+        begin = lowerBound<NL>(fd, begin, size, key, keyOf, compare, buffer,
+                               line);
+        if (begin < size) {
+            auto& r = results[i];
+            readLineAt<NL>(fd, begin, r.line);
+            auto&& k = keyOf(r.line);
+            r.found = not compare(key, k) and not compare(k, key);
+            if (not r.found)
+                r.line.clear();
+        }
+    }
+    return results;
+}
+
+inline
+int StringView::compare(StringView x) const {
+    auto c = memcmp(data_, x.data_, std::min(size_, x.size_));
+    if (c or size_ == x.size_)
+        return c;
+    return size_ < x.size_ ? -1 : 1;
+}
+
+inline
+bool operator==(StringView x, StringView y) {
+    return x.size() == y.size() and not memcmp(x.data(), y.data(), x.size());
+}
+
+inline
+bool operator!=(StringView x, StringView y) {
+    return not (x == y);
+}
+
+inline
+bool operator<(StringView x, StringView y) {
+    return x.compare(y) < 0;
+}
+
+/** The first bytes of a Snapshot file */
+struct SnapshotHeader {
+    char magic[8];
+    uint64_t count;
+    uint64_t blobSize;
+};
+
+static const char SNAPSHOT_MAGIC[8] = {'t', 'f', 'i', 'l', 'e', 's', 'n', '1'};
+
+template <typename Container>
+size_t saveSnapshot(const char* filename, const Container& strings) {
+    static const size_t BUFFER_SIZE = 0x100000;
+
+    // The header and the offset table go out as one write.
+    static const auto HEADER_WORDS = sizeof(SnapshotHeader) / sizeof(uint64_t);
+    std::vector<uint64_t> table(HEADER_WORDS + 1);
+    for (auto& s : strings)
+        table.push_back(table.back() + s.size());
+
+    SnapshotHeader header;
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.count = table.size() - HEADER_WORDS - 1;
+    header.blobSize = table.back();
+    memcpy(table.data(), &header, sizeof(header));
+
+    auto fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+        return 0;
+    }
+
+    auto tableBytes = table.size() * sizeof(uint64_t);
+    auto total = tableBytes + header.blobSize;
+    auto written = writeAll(fd, reinterpret_cast<const char*>(table.data()),
+                            tableBytes);
+
+    // Gather the strings into large writes; big ones go out directly.
+    std::string buffer;
+    buffer.reserve(std::min<size_t>(header.blobSize, BUFFER_SIZE));
+    auto flush = [&] () {
+        written += writeAll(fd, buffer.data(), buffer.size());
+        buffer.clear();
+    };
+    for (auto& s : strings) {
+        if (buffer.size() + s.size() > BUFFER_SIZE)
+            flush();
+        if (s.size() >= BUFFER_SIZE)
+            written += writeAll(fd, s.data(), s.size());
+        else
+            buffer.append(s.data(), s.size());
+    }
+    flush();
+
+    if (::close(fd))
+        written = 0;
+    if (written != total) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+        return 0;
+    }
+    return written;
+}
+
+inline
+Snapshot::Snapshot(const char* filename) {
+    auto fd = open(filename, O_RDONLY);
+    struct stat st;
+    SnapshotHeader header;
+    auto valid = fd >= 0 and not fstat(fd, &st) and
+            static_cast<size_t>(st.st_size) >= sizeof(header);
+
+    void* map = MAP_FAILED;
+    if (valid) {
+        map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        valid = map != MAP_FAILED;
+    }
+    if (fd >= 0)
+        ::close(fd);
 
-template <> struct Traits<Mode::read> { using Base = Read; };
-template <> struct Traits<Mode::readWrite> { using Base = ReadWrite; };
-template <> struct Traits<Mode::write> { using Base = Write; };
-template <> struct Traits<Mode::truncate> { using Base = ReadWrite; };
-template <> struct Traits<Mode::append> { using Base = Write; };
-template <> struct Traits<Mode::readAppend> { using Base = ReadWrite; };
+    if (valid) {
+        map_ = static_cast<char*>(map);
+        mapSize_ = st.st_size;
 
-template <> const char* newlineString<Newline::atari8>() { return "\x9b"; }
-template <> const char* newlineString<Newline::cr>() { return "\r"; }
-template <> const char* newlineString<Newline::cr_lf>() { return "\r\n"; }
-template <> const char* newlineString<Newline::lf>() { return "\n"; }
-template <> const char* newlineString<Newline::lf_cr>() { return "\n\r"; }
-template <> const char* newlineString<Newline::nl>() { return "\x15"; }
-template <> const char* newlineString<Newline::rs>() { return "\x1e"; }
-template <> const char* newlineString<Newline::zx8x>() { return "\x76"; }
+        // Only the header is checked: the offsets are trusted.
+        memcpy(&header, map_, sizeof(header));
+        auto tableBytes = (header.count + 1) * sizeof(uint64_t);
+        auto maxCount = mapSize_ / sizeof(uint64_t);
+        valid = not memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic))
+                and header.count < maxCount
+                and sizeof(header) + tableBytes + header.blobSize == mapSize_;
+        if (valid) {
+            offsets_ = reinterpret_cast<const uint64_t*>(
+                map_ + sizeof(header));
+            blob_ = map_ + sizeof(header) + tableBytes;
+            count_ = header.count;
+            valid = offsets_[count_] == header.blobSize;
+        }
+    }
 
-template <> const char* modeString<Mode::read>() { return "r"; }
-template <> const char* modeString<Mode::readWrite>() { return "r+"; }
-template <> const char* modeString<Mode::write>() { return "w"; }
-template <> const char* modeString<Mode::truncate>() { return "w+"; }
-template <> const char* modeString<Mode::append>() { return "a"; }
-template <> const char* modeString<Mode::readAppend>() { return "a+"; }
+    if (not valid) {
+        close();
+#ifdef __cpp_exceptions
+        throw std::runtime_error(filename);
+#endif
+    }
+}
 
-template <Mode MODE>
-class Opener : public Traits<MODE>::Base {
-  public:
-    using Base = typename Traits<MODE>::Base;
+inline
+Snapshot::Snapshot(Snapshot&& other) noexcept
+        : map_(other.map_), mapSize_(other.mapSize_),
+          offsets_(other.offsets_), blob_(other.blob_), count_(other.count_) {
+    other.map_ = nullptr;
+    other.mapSize_ = other.count_ = 0;
+    other.offsets_ = nullptr;
+    other.blob_ = nullptr;
+}
 
-    Opener() {}
+inline
+Snapshot& Snapshot::operator=(Snapshot&& other) {
+    if (this != &other) {
+        close();
+        std::swap(map_, other.map_);
+        std::swap(mapSize_, other.mapSize_);
+        std::swap(offsets_, other.offsets_);
+        std::swap(blob_, other.blob_);
+        std::swap(count_, other.count_);
+    }
+    return *this;
+}
 
-    explicit Opener(const char* filename) : Base(filename, modeString<MODE>()) {}
-    explicit Opener(Opener&& other) noexcept : Base(other.release()) {}
-    Opener(const Opener&) = delete;
+inline
+StringView Snapshot::operator[](size_t i) const {
+    return {blob_ + offsets_[i], offsets_[i + 1] - offsets_[i]};
+}
 
-    Opener& operator=(Opener&& other) {
-        this->set(other.release());
-        return *this;
+inline
+Snapshot::iterator Snapshot::begin() const {
+    return iterator(this, 0);
+}
+
+inline
+Snapshot::iterator Snapshot::end() const {
+    return iterator(this, count_);
+}
+
+inline
+void Snapshot::close() {
+    if (map_)
+        munmap(map_, mapSize_);
+    map_ = nullptr;
+    mapSize_ = count_ = 0;
+    offsets_ = nullptr;
+    blob_ = nullptr;
+}
+
+inline
+Snapshot loadSnapshot(const char* filename) {
+    return Snapshot(filename);
+}
+
+inline
+void putVarint(std::string& out, size_t n) {
+    while (n >= 0x80) {
+        out.push_back(static_cast<char>(n | 0x80));
+        n >>= 7;
     }
+    out.push_back(static_cast<char>(n));
+}
 
-    Opener& operator=(const Opener& other) = delete;
-};
+inline
+size_t getVarint(const std::string& in, size_t& offset) {
+    size_t n = 0;
+    for (int shift = 0; ; shift += 7) {
+        auto byte = static_cast<unsigned char>(in[offset++]);
+        n |= static_cast<size_t>(byte & 0x7f) << shift;
+        if (not (byte & 0x80))
+            return n;
+    }
+}
 
-template <typename SizeFunction>
-void testableRead(const char* filename, std::string& s, SizeFunction size) {
-    // The file size might change between getting the size and reading it: see
-    // https://www.reddit.com/r/cpp/comments/aiprv9/tiny_file_utilities/eerbyza/
+template <typename Container>
+FrontCoded::FrontCoded(const Container& strings) {
+    for (auto& s : strings)
+        push_back(s);
+    shrink_to_fit();
+}
 
-    s.resize(size(filename));
+inline
+void FrontCoded::push_back(const std::string& s) {
+    if (size_ % BUCKET_SIZE == 0) {
+        buckets_.push_back(data_.size());
+        putVarint(data_, s.size());
+        data_ += s;
+    } else {
+        auto n = std::min(s.size(), last_.size());
+        auto mismatch = std::mismatch(s.begin(), s.begin() + n, last_.begin());
+        size_t prefix = mismatch.first - s.begin();
+        putVarint(data_, prefix);
+        putVarint(data_, s.size() - prefix);
+        data_.append(s, prefix, std::string::npos);
+    }
+    last_ = s;
+    ++size_;
+}
+
+inline
+size_t FrontCoded::decode(size_t offset, bool head, std::string& s) const {
+    size_t prefix = head ? 0 : getVarint(data_, offset);
+    auto suffix = getVarint(data_, offset);
+    s.resize(prefix);
+    s.append(data_, offset, suffix);
+    return offset + suffix;
+}
+
+inline
+StringView FrontCoded::head(size_t bucket) const {
+    auto offset = buckets_[bucket];
+    auto length = getVarint(data_, offset);
+    return {data_.data() + offset, length};
+}
+
+inline
+std::string FrontCoded::operator[](size_t index) const {
+    std::string s;
+    auto offset = buckets_[index / BUCKET_SIZE];
+    for (size_t i = 0; i <= index % BUCKET_SIZE; ++i)
+        offset = decode(offset, not i, s);
+    return s;
+}
+
+inline
+size_t FrontCoded::find(const std::string& key) const {
+    // Find the last bucket whose head isn't greater than the key.
+    size_t lo = 0, hi = buckets_.size();
+    while (lo < hi) {
+        auto mid = lo + (hi - lo) / 2;
+        if (StringView(key) < head(mid))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    if (not lo)
+        return std::string::npos;
+
+    auto bucket = lo - 1;
+    auto offset = buckets_[bucket];
+    auto index = bucket * BUCKET_SIZE;
+    auto end = index + BUCKET_SIZE < size_ ? index + BUCKET_SIZE : size_;
+    std::string s;
+    for (auto i = index; i < end; ++i) {
+        offset = decode(offset, i == index, s);
+        if (s == key)
+            return i;
+        if (key < s)
+            break;
+    }
+    return std::string::npos;
+}
+
+inline
+size_t FrontCoded::bytes() const {
+    return sizeof(*this) + data_.capacity() + last_.capacity() +
+            buckets_.capacity() * sizeof(size_t);
+}
+
+inline
+void FrontCoded::shrink_to_fit() {
+    data_.shrink_to_fit();
+    buckets_.shrink_to_fit();
+}
+
+inline
+FrontCoded::iterator FrontCoded::begin() const {
+    return iterator(this, 0);
+}
+
+inline
+FrontCoded::iterator FrontCoded::end() const {
+    return iterator(this, size_);
+}
+
+inline
+FrontCoded::iterator::iterator(const FrontCoded* strings, size_t index)
+        : strings_(strings), index_(index) {
+    if (index_ < strings_->size_) {
+        offset_ = strings_->buckets_[index_ / BUCKET_SIZE];
+        for (auto i = index_ - index_ % BUCKET_SIZE; i <= index_; ++i)
+            load(i);
+    }
+}
+
+inline
+FrontCoded::iterator& FrontCoded::iterator::operator++() {
+    if (++index_ < strings_->size_)
+        load(index_);
+    return *this;
+}
+
+inline
+void FrontCoded::iterator::load(size_t index) {
+    offset_ = strings_->decode(offset_, index % BUCKET_SIZE == 0, current_);
+}
 
+template <Newline NL>
+FrontCoded readFrontCoded(const char* filename) {
+    FrontCoded result;
     Reader reader(filename);
-    s.resize(reader.read(s));
+    auto lines = reader.lines<NL>();
+    std::string line;
+    while (lines.readOne(line))
+        result.push_back(line);
+    result.shrink_to_fit();
+    return result;
+}
 
-    while (true) {
-        static const auto BUFFER_SIZE = 16;
-        char buffer[BUFFER_SIZE];
-        if (auto bytes = reader.read(buffer, BUFFER_SIZE))
-            s.insert(s.end(), buffer, buffer + bytes);
+inline
+InternPool::Handle InternPool::intern(const std::string& s) {
+    auto i = counts_.find(s);
+    if (i == counts_.end())
+        i = counts_.emplace(s, 0).first;
+    ++i->second;
+    return &i->first;
+}
+
+inline
+InternPool::Handle InternPool::find(const std::string& s) const {
+    auto i = counts_.find(s);
+    return i == counts_.end() ? nullptr : &i->first;
+}
+
+inline
+size_t InternPool::count(const std::string& s) const {
+    auto i = counts_.find(s);
+    return i == counts_.end() ? 0 : i->second;
+}
+
+template <Newline NL>
+std::vector<InternPool::Handle> readInterned(const char* filename,
+                                             InternPool& pool) {
+    std::vector<InternPool::Handle> result;
+    Reader reader(filename);
+    auto lines = reader.lines<NL>();
+    std::string line;
+    while (lines.readOne(line))
+        result.push_back(pool.intern(line));
+    return result;
+}
+
+template <Newline NL>
+size_t countLines(const char* filename) {
+    static const auto newline = newlineString<NL>();
+    static const auto newlineSize = strlen(newline);
+
+    Reader reader(filename);
+    auto fd = fileno(reader.get());
+    auto size = fileSize(fd);
+
+    size_t lines = 0;
+    scanMatches<NL>(fd, 0, size, newline, false, [&] (Match) {
+        ++lines;
+        return true;
+    });
+
+    // A last line without a newline still counts.
+    std::string tail(std::min(size, newlineSize), '\0');
+    if (size and readAt(fd, &tail[0], tail.size(), size - tail.size()) and
+        tail != newline) {
+        ++lines;
+    }
+    return lines;
+}
+
+/** The shared state of one walk(), owned by the caller and by each task it
+    has submitted */
+class Walk {
+  public:
+    Walk(Visitor visitor, Executor& executor)
+            : visitor_(visitor), executor_(executor) {}
+
+    /** An open directory: its children hold it open until they're read */
+    struct OpenDirectory {
+        explicit OpenDirectory(int fd) : fd(fd) {}
+        ~OpenDirectory() { ::close(fd); }
+        int fd;
+    };
+
+    /** A directory waiting to be read, or a batch of the files found in
+        one waiting to be stat'ed and visited */
+    struct Pending {
+        std::shared_ptr<OpenDirectory> parent;  // Null for the root
+        std::string path;  // For files, the path of `parent`
+        std::string name;
+        std::vector<std::string> files;
+    };
+
+    /** Queue a directory or files, to be handled by the executor or by
+        wait().  The newest directory is read first, so the walk is depth
+        first and only the directories along a few paths are held open. */
+    static void push(const std::shared_ptr<Walk>& self, Pending pending) {
+        {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            self->queue_.push_back(std::move(pending));
+            ++self->active_;
+        }
+        self->changed_.notify_all();
+        self->executor_.submit([self] () { runOne(self); });
+    }
+
+    /** Help read queued directories until all of them have been read, and
+        return the number of files visited */
+    static size_t wait(const std::shared_ptr<Walk>& self) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(self->mutex_);
+            self->changed_.wait(lock, [&] () {
+                return not self->active_ or not self->queue_.empty();
+            });
+            if (not self->active_) {
+#ifdef __cpp_exceptions
+                if (self->error_)
+                    std::rethrow_exception(self->error_);
+#endif
+                return self->files_;
+            }
+            lock.unlock();
+            runOne(self);
+        }
+    }
+
+  private:
+    static void runOne(const std::shared_ptr<Walk>& self) {
+        Pending pending;
+        {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            if (self->queue_.empty())
+                return;
+            pending = std::move(self->queue_.back());
+            self->queue_.pop_back();
+            ++self->reading_;
+        }
+
+        auto retry = false;
+        if (pending.files.empty())
+            retry = not read(self, pending);
         else
+            visit(self, pending);
+
+        std::unique_lock<std::mutex> lock(self->mutex_);
+        --self->reading_;
+
+        // Out of descriptors: try again after the others, as long as some
+        // are still being read and will close theirs.
+        if (retry and self->reading_) {
+            self->queue_.push_front(std::move(pending));
+            lock.unlock();
+            std::this_thread::yield();
+            self->executor_.submit([self] () { runOne(self); });
+            return;
+        }
+        if (not --self->active_)
+            self->changed_.notify_all();
+    }
+
+    /** Read a directory, returning false if it should be retried */
+    static bool read(const std::shared_ptr<Walk>& self, const Pending&);
+
+    /** Stat a batch of files, visiting the regular ones */
+    static void visit(const std::shared_ptr<Walk>& self, const Pending&);
+
+    /** Call the visitor.  The first exception it throws stops the walk, and
+        is rethrown by wait(). */
+    static void call(const std::shared_ptr<Walk>& self,
+                     const WalkEntry& entry) {
+#ifdef __cpp_exceptions
+        try {
+            self->visitor_(entry);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(self->mutex_);
+            if (not self->error_)
+                self->error_ = std::current_exception();
+            self->stopped_ = true;
+        }
+#else
+        self->visitor_(entry);
+#endif
+        ++self->files_;
+    }
+
+    Visitor visitor_;
+    Executor& executor_;
+    std::atomic<size_t> files_{0};
+    std::atomic<bool> stopped_{false};
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Pending> queue_;
+    size_t active_ = 0;  // Directories and batches queued or in progress
+    size_t reading_ = 0;  // Directories and batches in progress
+#ifdef __cpp_exceptions
+    std::exception_ptr error_;  // The first exception a visitor threw
+#endif
+};
+
+inline
+bool Walk::read(const std::shared_ptr<Walk>& self, const Pending& pending) {
+    // Once a visitor has thrown, the queue is only drained.
+    if (self->stopped_)
+        return true;
+
+    auto outOfDescriptors = [] () {
+        return errno == EMFILE or errno == ENFILE;
+    };
+
+    auto parent = pending.parent ? pending.parent->fd : AT_FDCWD;
+    auto flags = O_RDONLY | O_DIRECTORY;
+    if (pending.parent)
+        flags |= O_NOFOLLOW;
+    auto fd = openat(parent, pending.name.c_str(), flags);
+    if (fd < 0)
+        return not outOfDescriptors();
+    auto directory = std::make_shared<OpenDirectory>(fd);
+
+    // fdopendir owns the descriptor it's given, so give it a copy.
+    auto copy = dup(fd);
+    auto dir = copy < 0 ? nullptr : fdopendir(copy);
+    if (not dir) {
+        auto retry = outOfDescriptors();
+        if (copy >= 0)
+            ::close(copy);
+        return not retry;
+    }
+
+    // Files are stat'ed and visited in batches, so a large directory is
+    // spread over several tasks.  The last batch is visited here.
+    static const size_t BATCH_SIZE = 0x100;
+    std::vector<std::string> files;
+    while (auto entry = readdir(dir)) {
+        if (self->stopped_)
             break;
+        auto name = entry->d_name;
+        if (not strcmp(name, ".") or not strcmp(name, ".."))
+            continue;
+
+        // Regular files need their size; other types are usually known.
+        auto type = entry->d_type;
+        if (type == DT_DIR) {
+            push(self, {directory, pending.path + "/" + name, name, {}});
+        } else if (type == DT_UNKNOWN or type == DT_REG) {
+            files.emplace_back(name);
+            if (files.size() == BATCH_SIZE) {
+                push(self, {directory, pending.path, {}, std::move(files)});
+                files.clear();
+            }
+        }
     }
+    closedir(dir);
+
+    if (not files.empty())
+        visit(self, {directory, pending.path, {}, std::move(files)});
+    return true;
 }
 
 inline
-void read(const char* filename, std::string& s) {
-    testableRead(filename, s, size);
+void Walk::visit(const std::shared_ptr<Walk>& self, const Pending& pending) {
+    auto fd = pending.parent->fd;
+    for (auto& name : pending.files) {
+        if (self->stopped_)
+            return;
+        struct stat st;
+        if (fstatat(fd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW))
+            continue;
+
+        auto path = pending.path + "/" + name;
+        if (S_ISDIR(st.st_mode)) {
+            push(self, {pending.parent, std::move(path), name, {}});
+        } else if (S_ISREG(st.st_mode)) {
+            call(self, {std::move(path), fd, name.c_str(),
+                        static_cast<size_t>(st.st_size)});
+        }
+    }
 }
 
+inline
+size_t walk(const char* root, Visitor visitor, Executor* executor) {
+    struct stat st;
+    if (stat(root, &st) or not S_ISDIR(st.st_mode)) {
+#ifdef __cpp_exceptions
+        throw std::runtime_error(root);
+#endif
+        return 0;
+    }
+
+    // Children's paths are built as path + "/" + name.
+    std::string path = root;
+    while (not path.empty() and path.back() == '/')
+        path.pop_back();
+
+    auto& e = executor ? *executor : defaultExecutor();
+    auto state = std::make_shared<Walk>(visitor, e);
+    Walk::push(state, {nullptr, path, root, {}});
+    return Walk::wait(state);
+}
 
 inline
-std::string read(const char* filename) {
-    std::string s;
-    read(filename, s);
-    return s;
+Directory::Directory(const char* path) {
+    open(AT_FDCWD, path);
 }
 
 inline
-size_t write(const char* filename, const char* data, size_t length) {
-    return Writer(filename).write(data, length);
+Directory::Directory(const Directory& parent, const char* name) {
+    open(parent.fd_, name);
 }
 
 inline
-size_t write(const char* filename, const char* data) {
-    return write(filename, data, strlen(data));
+Directory::Directory(Directory&& other) noexcept : fd_(other.fd_) {
+    other.fd_ = -1;
 }
 
 inline
-size_t write(const char* filename, const std::string& s) {
-    return write(filename, s.data(), s.size());
+Directory& Directory::operator=(Directory&& other) {
+    if (this != &other) {
+        close();
+        std::swap(fd_, other.fd_);
+    }
+    return *this;
 }
 
 inline
-void readLines(const char* filename, Lines& lines) {
-    Reader(filename).lines().read(lines);
+void Directory::open(int parent, const char* path) {
+    fd_ = openat(parent, path, O_RDONLY | O_DIRECTORY);
+#ifdef __cpp_exceptions
+    if (fd_ < 0)
+        throw std::runtime_error(path);
+#endif
 }
 
 inline
-Lines readLines(const char* filename) {
-    return Reader(filename).lines().read();
+int Directory::close() {
+    if (fd_ < 0)
+        return 0;
+    auto result = ::close(fd_);
+    fd_ = -1;
+    return result;
 }
 
+/** The open() flags that match fopen() in each Mode */
 inline
-size_t writeLines(const char* filename, const Lines& lines) {
-    return writeLines<>(filename, lines);
+int openFlags(Mode mode) {
+    switch (mode) {
+        case Mode::read: return O_RDONLY;
+        case Mode::readWrite: return O_RDWR;
+        case Mode::write: return O_WRONLY | O_CREAT | O_TRUNC;
+        case Mode::truncate: return O_RDWR | O_CREAT | O_TRUNC;
+        case Mode::append: return O_WRONLY | O_CREAT | O_APPEND;
+        case Mode::readAppend: return O_RDWR | O_CREAT | O_APPEND;
+    }
+    return O_RDONLY;
 }
 
 inline
-size_t size(const char* filename) {
-    // From http://stackoverflow.com/questions/5840148
-    std::ifstream in(filename, std::ifstream::ate | std::ifstream::binary);
-    return in.tellg();
+FILE* Directory::open(const char* name, Mode mode) const {
+    auto fd = openat(fd_, name, openFlags(mode), 0666);
+    if (fd < 0)
+        return nullptr;
+    auto file = fdopen(fd, modeString(mode));
+    if (not file)
+        ::close(fd);
+    return file;
 }
 
-template <typename Container>
-size_t writeLines(const char* filename, Container c) {
-    return Writer(filename).writeLines().write(c);
+template <Mode MODE>
+Opener<MODE>::Opener(const Directory& directory, const char* name)
+        : Base(directory.open(name, MODE)) {
+#ifdef __cpp_exceptions
+    if (not this->get())
+        throw std::runtime_error(name);
+#endif
 }
 
-template <typename ForwardIt>
-size_t writeLines(const char* filename, ForwardIt begin, ForwardIt end) {
-    return Writer(filename).writeLines().write(begin, end);
+inline
+void Directory::read(const char* name, std::string& s) const {
+    static const size_t BUFFER_SIZE = 0x1000;
+
+    Reader reader(*this, name);
+    s.resize(fileSize(fileno(reader.get())));
+    s.resize(reader.read(s));
+
+    // The file may have grown since it was measured.
+    char buffer[BUFFER_SIZE];
+    while (auto bytes = reader.read(buffer, BUFFER_SIZE))
+        s.append(buffer, bytes);
+}
+
+inline
+std::string Directory::read(const char* name) const {
+    std::string s;
+    read(name, s);
+    return s;
+}
+
+inline
+Lines Directory::readLines(const char* name) const {
+    return Reader(*this, name).lines().read();
+}
+
+inline
+size_t Directory::write(const char* name, const char* data,
+                        size_t length) const {
+    Writer writer(*this, name);
+    writer.preallocate(length);
+    return writer.write(data, length);
+}
+
+inline
+size_t Directory::write(const char* name, const std::string& s) const {
+    return write(name, s.data(), s.size());
+}
+
+inline
+size_t Directory::size(const char* name) const {
+    struct stat st;
+    return fstatat(fd_, name, &st, 0) ? static_cast<size_t>(-1) : st.st_size;
 }
 
 }  // namespace tfile
@@ -1,4 +1,9 @@
+#include <signal.h>
+
+#include <future>
 #include <iostream>
+#include <map>
+#include <set>
 #include <tfile/tfile.h>
 
 #define CATCH_CONFIG_MAIN
@@ -219,3 +224,1056 @@ TEST_CASE("multiple inheritance", "[multiple inheritance]") {
     REQUIRE(d3.get1() == 1);
     REQUIRE(d3.get2() == 2);
 }
+
+TEST_CASE("writeIfDifferent", "[writeIfDifferent]") {
+    FileDeleter d1{testFilename};
+    remove(testFilename);
+
+    using tfile::WriteResult;
+    REQUIRE(tfile::writeIfDifferent(testFilename, "hello") ==
+            WriteResult::created);
+
+    struct stat before, after;
+    REQUIRE(stat(testFilename, &before) == 0);
+    REQUIRE(tfile::writeIfDifferent(testFilename, "hello") ==
+            WriteResult::unchanged);
+    REQUIRE(stat(testFilename, &after) == 0);
+    REQUIRE(before.st_ino == after.st_ino);
+
+    // Same size, different contents.
+    REQUIRE(tfile::writeIfDifferent(testFilename, "jello") ==
+            WriteResult::changed);
+    REQUIRE(tfile::read(testFilename) == "jello");
+
+    REQUIRE(tfile::writeIfDifferent(testFilename, "jell") ==
+            WriteResult::changed);
+    REQUIRE(tfile::read(testFilename) == "jell");
+    // A path that can't be opened for a reason other than being missing.
+    auto bad = std::string(testFilename) + "/child";
+    REQUIRE_THROWS(tfile::writeIfDifferent(bad.c_str(), "hello"));
+}
+
+TEST_CASE("preallocate", "[preallocate]") {
+    FileDeleter d1{testFilename};
+
+    {
+        tfile::Writer writer(testFilename);
+        writer.preallocate(0x10000);
+        writer.write("hello");
+    }
+    // Preallocation never changes the size of the file.
+    REQUIRE(tfile::size(testFilename) == 5);
+
+    tfile::Lines lines(1000, "a line of text");
+    tfile::writeLines(testFilename, lines);
+    REQUIRE(tfile::size(testFilename) == 15000);
+    REQUIRE(tfile::readLines(testFilename) == lines);
+}
+
+TEST_CASE("sortLines", "[sortLines]") {
+    FileDeleter d1{testFilename}, d2{testFilename2};
+
+    tfile::Lines lines;
+    for (int i = 0; i < 10000; ++i)
+        lines.push_back(std::to_string((i * 7919) % 10007));
+    tfile::writeLines(testFilename, lines);
+    std::sort(lines.begin(), lines.end());
+
+    // A tiny budget forces many spilled runs.
+    tfile::sortLines(testFilename, testFilename2, 0x8000);
+    REQUIRE(tfile::readLines(testFilename2) == lines);
+
+    tfile::sortLines(testFilename, testFilename2);
+    REQUIRE(tfile::readLines(testFilename2) == lines);
+
+    std::reverse(lines.begin(), lines.end());
+    tfile::sortLines(testFilename, testFilename2, 0x8000,
+                     std::greater<std::string>());
+    REQUIRE(tfile::readLines(testFilename2) == lines);
+    // Hundreds of runs with few files allowed need intermediate merges.
+    lines.clear();
+    for (int i = 0; i < 200000; ++i)
+        lines.push_back(std::to_string((i * 7919) % 200003));
+    tfile::writeLines(testFilename, lines);
+    std::sort(lines.begin(), lines.end());
+
+    struct rlimit before, lowered;
+    REQUIRE(getrlimit(RLIMIT_NOFILE, &before) == 0);
+    lowered = before;
+    lowered.rlim_cur = 64;
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+    tfile::sortLines(testFilename, testFilename2, 0x4000);
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &before) == 0);
+    REQUIRE(tfile::readLines(testFilename2) == lines);
+
+    // Runs or output that can't be written in full fail the sort: with no
+    // spills, with spills, and with intermediate merges.
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit sizeBefore, sizeLowered;
+    REQUIRE(getrlimit(RLIMIT_FSIZE, &sizeBefore) == 0);
+    sizeLowered = sizeBefore;
+    sizeLowered.rlim_cur = 0x40000;
+    REQUIRE(setrlimit(RLIMIT_FSIZE, &sizeLowered) == 0);
+    REQUIRE_THROWS(tfile::sortLines(testFilename, testFilename2));
+    REQUIRE_THROWS(tfile::sortLines(testFilename, testFilename2, 0x800000));
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+    REQUIRE_THROWS(tfile::sortLines(testFilename, testFilename2, 0x4000));
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &before) == 0);
+    REQUIRE(setrlimit(RLIMIT_FSIZE, &sizeBefore) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+
+    REQUIRE_THROWS(tfile::sortLines("/tmp/tfile.no.such.file",
+                                    testFilename2));
+}
+
+TEST_CASE("mergeSorted", "[mergeSorted]") {
+    auto const testFilename3 = "/tmp/tfile.file3.txt";
+    FileDeleter d1{testFilename}, d2{testFilename2}, d3{testFilename3};
+
+    tfile::writeLines(testFilename, {"apple", "cherry", "fig"});
+    tfile::writeLines(testFilename2, {"banana", "cherry", "date"});
+
+    std::vector<std::string> inputs{testFilename, testFilename2};
+    tfile::mergeSorted(inputs, testFilename3);
+    tfile::Lines expected{
+        "apple", "banana", "cherry", "cherry", "date", "fig"};
+    REQUIRE(tfile::readLines(testFilename3) == expected);
+
+    tfile::mergeSorted(inputs, testFilename3, std::less<std::string>(), true);
+    expected.erase(expected.begin() + 3);
+    REQUIRE(tfile::readLines(testFilename3) == expected);
+
+    inputs.push_back("/tmp/tfile.no.such.file");
+    REQUIRE_THROWS(tfile::mergeSorted(inputs, testFilename3));
+    inputs.pop_back();
+
+    // An output that can't be written in full fails the merge.
+    tfile::Lines lines;
+    for (int i = 0; i < 100000; ++i)
+        lines.push_back(std::to_string(100000 + i));
+    tfile::writeLines(testFilename, lines);
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit before, lowered;
+    REQUIRE(getrlimit(RLIMIT_FSIZE, &before) == 0);
+    lowered = before;
+    lowered.rlim_cur = 0x40000;
+    REQUIRE(setrlimit(RLIMIT_FSIZE, &lowered) == 0);
+    REQUIRE_THROWS(tfile::mergeSorted(inputs, testFilename3));
+    REQUIRE(setrlimit(RLIMIT_FSIZE, &before) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+}
+
+TEST_CASE("find", "[find]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines;
+    for (int i = 0; i < 400000; ++i)
+        lines.push_back(i % 1000 ? "nothing here" : "a needle here");
+    tfile::writeLines(testFilename, lines);
+
+    auto match = tfile::find(testFilename, "needle");
+    REQUIRE(match.offset == 2);
+    REQUIRE(match.line == 0);
+    REQUIRE(tfile::find(testFilename, "haystack").offset == std::string::npos);
+
+    auto matches = tfile::findAll(testFilename, "needle", 4);
+    REQUIRE(matches.size() == 400);
+    REQUIRE(matches[1].line == 1000);
+    REQUIRE(matches[1].offset == 14 + 999 * 13 + 2);
+    REQUIRE(matches[399].line == 399000);
+    REQUIRE(tfile::findAll(testFilename, "needle", 1).back().line == 399000);
+
+    REQUIRE(tfile::countMatches(testFilename, "here", 4) == 400000);
+    REQUIRE(tfile::countMatches(testFilename, "ee") == 400);
+}
+
+TEST_CASE("pipeline", "[pipeline]") {
+    FileDeleter d1{testFilename};
+    tfile::writeLines(testFilename, {"1", "", "22", "333", "", "4444", "55555"});
+
+    struct NotEmpty {
+        bool operator()(const std::string& s) const { return not s.empty(); }
+    };
+    struct Length {
+        size_t operator()(const std::string& s) const { return s.size(); }
+    };
+
+    tfile::Reader reader(testFilename);
+    std::vector<size_t> lengths;
+    reader.lines().filter(NotEmpty()).map(Length()).take(3).forEach(
+        [&] (size_t n) { lengths.push_back(n); });
+    REQUIRE(lengths == std::vector<size_t>({1, 2, 3}));
+
+    // take stops reading right after its last line.
+    std::string line;
+    REQUIRE(reader.lines().readOne(line));
+    REQUIRE(line == "");
+}
+
+TEST_CASE("checkpoint", "[checkpoint]") {
+    FileDeleter d1{testFilename}, d2{testFilename2};
+    tfile::write(testFilename, "one\r\ntwo\r\nthree\r\nfour\r\n");
+    tfile::write(testFilename2, "other");
+
+    tfile::Checkpoint checkpoint;
+    {
+        tfile::Reader reader(testFilename);
+        auto lines = reader.lines<tfile::Newline::windows>();
+        std::string line;
+        REQUIRE(lines.readOne(line));
+        REQUIRE(lines.readOne(line));
+        REQUIRE(line == "two");
+        REQUIRE(lines.offset() == 10);
+        REQUIRE(lines.lineNumber() == 2);
+        checkpoint = lines.checkpoint();
+    }
+
+    tfile::Reader reader(testFilename);
+    tfile::LineReader<tfile::Newline::windows, tfile::ReaderBase<tfile::Read>>
+        lines(reader, checkpoint);
+    std::string line;
+    REQUIRE(lines.readOne(line));
+    REQUIRE(line == "three");
+    REQUIRE(lines.lineNumber() == 3);
+    REQUIRE(lines.offset() == 17);
+
+    tfile::Reader other(testFilename2);
+    REQUIRE_THROWS(tfile::LineReader<
+        tfile::Newline::system, tfile::ReaderBase<tfile::Read>>(
+            other, checkpoint));
+    // Pipelines on a named reader advance it.
+    tfile::write(testFilename, "a\nb\nc\nd\n");
+    tfile::Reader piped(testFilename);
+    auto pipedLines = piped.lines<tfile::Newline::unix>();
+    tfile::Lines taken;
+    pipedLines.take(2).forEach([&] (const std::string& s) {
+        taken.push_back(s);
+    });
+    REQUIRE(taken == (tfile::Lines{"a", "b"}));
+    REQUIRE(pipedLines.checkpoint().offset == 4);
+    REQUIRE(pipedLines.checkpoint().line == 2);
+    REQUIRE(pipedLines.readOne(line));
+    REQUIRE(line == "c");
+    REQUIRE(pipedLines.offset() == 6);
+}
+
+TEST_CASE("split", "[split]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines;
+    for (int i = 0; i < 1000; ++i)
+        lines.push_back(std::string(i % 37, 'x') + std::to_string(i));
+    tfile::writeLines(testFilename, lines);
+
+    auto check = [&] (const std::vector<std::string>& shards) {
+        tfile::Lines result;
+        for (auto& shard : shards) {
+            tfile::readLines(shard.c_str(), result);
+            remove(shard.c_str());
+        }
+        REQUIRE(result == lines);
+    };
+
+    auto shards = tfile::split(testFilename, 7);
+    REQUIRE(shards.size() == 7);
+    REQUIRE(shards[3] == std::string(testFilename) + ".3");
+    check(shards);
+
+    shards = tfile::splitBytes(testFilename, 1000);
+    REQUIRE(shards.size() == (tfile::size(testFilename) + 999) / 1000);
+    check(shards);
+}
+
+TEST_CASE("MappedWriter", "[MappedWriter]") {
+    FileDeleter d1{testFilename};
+
+    {
+        tfile::MappedWriter writer(testFilename);
+        writer.write("header: ????\n");
+        for (int i = 0; i < 100000; ++i)
+            writer.write("a line of text\n");
+
+        auto p = writer.append(5);
+        memcpy(p, "done\n", 5);
+
+        // Patch the header now the size is known.
+        memcpy(writer.data() + 8, "full", 4);
+        REQUIRE(writer.size() == 13 + 1500000 + 5);
+    }
+
+    REQUIRE(tfile::size(testFilename) == 13 + 1500000 + 5);
+    auto lines = tfile::readLines(testFilename);
+    REQUIRE(lines.size() == 100002);
+    REQUIRE(lines.front() == "header: full");
+    REQUIRE(lines.back() == "done");
+
+    // Growing past what the file may hold fails at once, not on a store.
+    signal(SIGXFSZ, SIG_IGN);
+    struct rlimit before, lowered;
+    REQUIRE(getrlimit(RLIMIT_FSIZE, &before) == 0);
+    lowered = before;
+    lowered.rlim_cur = 0x100000;
+    REQUIRE(setrlimit(RLIMIT_FSIZE, &lowered) == 0);
+    {
+        tfile::MappedWriter writer(testFilename);
+        REQUIRE_THROWS(writer.append(0x400000));
+    }
+    REQUIRE(setrlimit(RLIMIT_FSIZE, &before) == 0);
+    signal(SIGXFSZ, SIG_DFL);
+}
+
+TEST_CASE("RotatingAppender", "[RotatingAppender]") {
+    std::string name = testFilename;
+    auto segment = [&] (int i) { return name + "." + std::to_string(i); };
+    auto exists = [] (const std::string& s) {
+        return tfile::size(s.c_str()) != static_cast<size_t>(-1);
+    };
+    FileDeleter d1{testFilename};
+    remove(testFilename);
+
+    std::vector<std::string> rotated;
+    {
+        tfile::RotatingAppender appender(
+            testFilename, 21, std::chrono::seconds(0), 2,
+            [&] (const std::string& s) { rotated.push_back(s); });
+        for (int i = 0; i < 10; ++i)
+            appender.writeLine("line " + std::to_string(i));
+    }
+
+    // Each segment holds three seven-byte lines, and two are kept.
+    REQUIRE(tfile::read(testFilename) == "line 9\n");
+    REQUIRE(not exists(segment(1)));
+    REQUIRE(tfile::read(segment(2).c_str()) == "line 3\nline 4\nline 5\n");
+    REQUIRE(tfile::read(segment(3).c_str()) == "line 6\nline 7\nline 8\n");
+    REQUIRE(rotated == (std::vector<std::string>{
+        segment(1), segment(2), segment(3)}));
+
+    // Numbering carries on; compressed segments are pruned too; and a
+    // slow callback doesn't hold up writes that rotate.
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    std::atomic<bool> blocked{false};
+    {
+        tfile::RotatingAppender appender(
+            testFilename, 7, std::chrono::seconds(0), 2,
+            [&] (const std::string& s) {
+                if (released.wait_for(std::chrono::seconds(5)) !=
+                    std::future_status::ready) {
+                    blocked = true;
+                }
+                rename(s.c_str(), (s + ".gz").c_str());
+            });
+        for (int i = 0; i < 5; ++i)
+            appender.writeLine("line " + std::to_string(i));
+        release.set_value();
+    }
+    REQUIRE(not blocked);
+    REQUIRE(tfile::read(testFilename) == "line 4\n");
+    for (int i = 1; i <= 6; ++i)
+        REQUIRE(not exists(segment(i)));
+    REQUIRE(not exists(segment(6) + ".gz"));
+    REQUIRE(tfile::read((segment(7) + ".gz").c_str()) == "line 2\n");
+    REQUIRE(tfile::read((segment(8) + ".gz").c_str()) == "line 3\n");
+
+    remove((segment(7) + ".gz").c_str());
+    remove((segment(8) + ".gz").c_str());
+
+    // A file that can't be renamed isn't counted as rotated.
+    rotated.clear();
+    {
+        tfile::RotatingAppender appender(
+            testFilename, 100, std::chrono::seconds(0), 2,
+            [&] (const std::string& s) { rotated.push_back(s); });
+        appender.writeLine("kept");
+        remove(testFilename);
+        REQUIRE_THROWS(appender.rotate());
+        appender.writeLine("again");
+        tfile::write(testFilename, "");
+        REQUIRE(appender.rotate());
+    }
+    REQUIRE(rotated == std::vector<std::string>{segment(1)});
+    REQUIRE(tfile::read(segment(1).c_str()) == "");
+    REQUIRE(not exists(segment(2)));
+    remove(segment(1).c_str());
+}
+
+TEST_CASE("SharedAppender", "[SharedAppender]") {
+    FileDeleter d1{testFilename};
+    remove(testFilename);
+
+    static const int THREADS = 8, LINES = 1000;
+    const std::string line(100, 'x');
+    {
+        tfile::SharedAppender appender(testFilename);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < THREADS; ++i) {
+            threads.emplace_back([&] () {
+                for (int j = 0; j < LINES; ++j)
+                    appender.writeLine(line);
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+
+        appender.writeLines(tfile::Lines{"one", "two"});
+    }
+
+    auto lines = tfile::readLines(testFilename);
+    REQUIRE(lines.size() == THREADS * LINES + 2);
+    REQUIRE(std::count(lines.begin(), lines.end(), line) == THREADS * LINES);
+    REQUIRE(lines.back() == "two");
+}
+
+TEST_CASE("streambuf", "[streambuf]") {
+    FileDeleter d1{testFilename};
+
+    {
+        tfile::Writer writer(testFilename);
+        writer.write("first ");
+        tfile::streambuf buf(writer, 16);
+        std::ostream out(&buf);
+        out << "line " << 1 << "\n" << std::string(100, 'x') << "\n";
+    }
+    REQUIRE(tfile::size(testFilename) == 6 + 7 + 101);
+
+    tfile::Reader reader(testFilename);
+    std::string word;
+    {
+        tfile::streambuf buf(reader, 16);
+        std::istream in(&buf);
+        int n;
+        in >> word >> word >> n;
+        REQUIRE(word == "line");
+        REQUIRE(n == 1);
+    }
+
+    // The reader continues where the stream stopped.
+    std::string rest;
+    REQUIRE(reader.lines().readOne(rest));
+    REQUIRE(rest == "");
+    REQUIRE(reader.lines().readOne(rest));
+    REQUIRE(rest == std::string(100, 'x'));
+
+    // tellg and seekg, as legacy stream code uses them.
+    {
+        tfile::Reader again(testFilename);
+        tfile::streambuf buf(again, 16);
+        std::istream in(&buf);
+        REQUIRE(in.tellg() == 0);
+        in >> word;
+        REQUIRE(in.tellg() == 5);
+        in.seekg(6);
+        in >> word;
+        REQUIRE(word == "line");
+        in.seekg(-4, std::ios_base::end);
+        in >> word;
+        REQUIRE(word == "xxx");
+        REQUIRE(in);
+    }
+    {
+        tfile::Writer writer(testFilename);
+        tfile::streambuf buf(writer, 16);
+        std::ostream out(&buf);
+        out << "hello world";
+        REQUIRE(out.tellp() == 11);
+        out.seekp(0);
+        out << "j";
+    }
+    REQUIRE(tfile::read(testFilename) == "jello world");
+
+    // A Reader with no file makes an empty stream rather than crashing.
+    tfile::Reader none;
+    {
+        tfile::streambuf buf(none);
+        std::istream in(&buf);
+        REQUIRE(not (in >> word));
+    }
+
+    // A buffer size of 0 still reads and writes.
+    {
+        tfile::Writer writer(testFilename);
+        tfile::streambuf buf(writer, 0);
+        std::ostream out(&buf);
+        out << 'x' << "yz";
+    }
+    REQUIRE(tfile::read(testFilename) == "xyz");
+    {
+        tfile::Reader reader(testFilename);
+        tfile::streambuf buf(reader, 0);
+        std::istream in(&buf);
+        REQUIRE(in >> word);
+        REQUIRE(word == "xyz");
+    }
+}
+
+TEST_CASE("utf8", "[utf8]") {
+    FileDeleter d1{testFilename};
+
+    auto npos = std::string::npos;
+    std::string valid = "ascii \xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80 end";
+    REQUIRE(tfile::validateUtf8(valid.data(), valid.size()) == npos);
+    REQUIRE(tfile::validateUtf8("ab\xff", 3) == 2);
+    REQUIRE(tfile::validateUtf8("\xc0\xaf", 2) == 0);  // Overlong
+    REQUIRE(tfile::validateUtf8("\xed\xa0\x80", 3) == 0);  // Surrogate
+    REQUIRE(tfile::validateUtf8("abc\xe2\x82", 5) == 3);  // Truncated
+
+    std::string text;
+    for (int i = 0; i < 20000; ++i)
+        text += valid + "\n";
+    tfile::write(testFilename, text);
+
+    std::string s;
+    REQUIRE(tfile::readUtf8(testFilename, s) == npos);
+    REQUIRE(s == text);
+
+    text[150000] = '\x80';
+    tfile::write(testFilename, text);
+    REQUIRE(tfile::readUtf8(testFilename, s) == 150000);
+    REQUIRE(s == text);
+
+    tfile::Reader reader(testFilename);
+    auto lines = reader.lines<tfile::Newline::unix>().validateUtf8();
+    size_t count = 0;
+    lines.forEach([&] (const std::string&) { ++count; });
+    REQUIRE(count == 150000 / (valid.size() + 1));
+    REQUIRE(lines.invalidOffset() == 150000);
+}
+
+TEST_CASE("convertNewlines", "[convertNewlines]") {
+    FileDeleter d1{testFilename}, d2{testFilename2};
+    using tfile::Newline;
+
+    std::string windows, unix;
+    for (int i = 0; i < 100000; ++i) {
+        auto line = "line " + std::to_string(i);
+        windows += line + "\r\n";
+        unix += line + "\n";
+    }
+    windows += "last\r";
+    unix += "last\r";
+    tfile::write(testFilename, windows);
+
+    REQUIRE(tfile::detectNewline(testFilename) == Newline::windows);
+    REQUIRE(tfile::convertNewlines(testFilename, testFilename2, Newline::unix)
+            == unix.size());
+    REQUIRE(tfile::read(testFilename2) == unix);
+
+    tfile::convertNewlines(testFilename2, testFilename, Newline::unix,
+                           Newline::windows);
+    REQUIRE(tfile::read(testFilename) == windows);
+
+    REQUIRE(tfile::convertNewlines(testFilename, Newline::windows,
+                                   Newline::unix) == unix.size());
+    REQUIRE(tfile::read(testFilename) == unix);
+    // A full disk is an error, not a short file.
+    REQUIRE_THROWS(tfile::convertNewlines(testFilename, "/dev/full",
+                                          Newline::unix, Newline::windows));
+}
+
+TEST_CASE("line options", "[line options]") {
+    FileDeleter d1{testFilename};
+    tfile::write(testFilename,
+                 "  one  \r\n# comment\r\n\r\n  #indented\r\n"
+                 "abcdefghij\r\nlast");
+
+    auto read = [&] (const tfile::LineOptions& options) {
+        tfile::Reader reader(testFilename);
+        return reader.lines<tfile::Newline::windows>().options(options)
+            .read();
+    };
+
+    tfile::LineOptions options;
+    options.trim = true;
+    options.skipEmpty = true;
+    options.skipPrefix = "#";
+    REQUIRE(read(options) == tfile::Lines({"one", "abcdefghij", "last"}));
+
+    options.maxLength = 4;
+    REQUIRE(read(options) == tfile::Lines({"one", "abcd", "last"}));
+
+    // Only the end of the whole line is trimmed: "one  " is split into
+    // "one " and " ", and the all-whitespace last piece is dropped.
+    options.overflow = tfile::Overflow::split;
+    REQUIRE(read(options) ==
+            tfile::Lines({"one ", "abcd", "efgh", "ij", "last"}));
+
+    options.overflow = tfile::Overflow::error;
+    options.maxLength = 5;
+    tfile::Reader reader(testFilename);
+    auto lines = reader.lines<tfile::Newline::windows>().options(options);
+    REQUIRE(lines.read() == tfile::Lines({"one"}));
+    REQUIRE(lines.overflowOffset() == 35);
+
+    // The pieces of a split line are never trimmed, skipped as comments or
+    // skipped as empty in the middle of the line.
+    tfile::write(testFilename, "abcd#efgh\nab    cd\nabcd    \nx\n");
+    tfile::LineOptions split;
+    split.maxLength = 4;
+    split.overflow = tfile::Overflow::split;
+    split.skipPrefix = "#";
+    tfile::Reader pieces(testFilename);
+    REQUIRE(pieces.lines().options(split).read() == tfile::Lines(
+        {"abcd", "#efg", "h", "ab  ", "  cd", "abcd", "    ", "x"}));
+
+    split.skipPrefix = "";
+    split.trim = true;
+    split.skipEmpty = true;
+    tfile::Reader again(testFilename);
+    auto splitLines = again.lines().options(split);
+    REQUIRE(splitLines.read() == tfile::Lines(
+        {"abcd", "#efg", "h", "ab  ", "  cd", "abcd", "x"}));
+    REQUIRE(splitLines.lineNumber() == 4);
+
+    // Validated lines are cut between characters, and an invalid byte is
+    // reported at its offset in the file, before any trimming.
+    tfile::write(testFilename, "\xc3\xa9\xc3\xa9\xc3\xa9\nok\n");
+    tfile::LineOptions utf8;
+    utf8.maxLength = 3;
+    tfile::Reader truncated(testFilename);
+    auto truncatedLines = truncated.lines().options(utf8).validateUtf8();
+    REQUIRE(truncatedLines.read() == tfile::Lines({"\xc3\xa9", "ok"}));
+    REQUIRE(truncatedLines.invalidOffset() == std::string::npos);
+
+    utf8.overflow = tfile::Overflow::split;
+    tfile::Reader cut(testFilename);
+    auto cutLines = cut.lines().options(utf8).validateUtf8();
+    REQUIRE(cutLines.read() == tfile::Lines(
+        {"\xc3\xa9", "\xc3\xa9", "\xc3\xa9", "ok"}));
+    REQUIRE(cutLines.invalidOffset() == std::string::npos);
+
+    tfile::write(testFilename, "ok\n  \xff\n");
+    tfile::LineOptions trim;
+    trim.trim = true;
+    tfile::Reader invalid(testFilename);
+    auto invalidLines = invalid.lines().options(trim).validateUtf8();
+    REQUIRE(invalidLines.read() == tfile::Lines({"ok"}));
+    REQUIRE(invalidLines.invalidOffset() == 5);
+}
+
+TEST_CASE("ranges", "[ranges]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines;
+    for (int i = 0; i < 1000; ++i)
+        lines.push_back(std::string(i % 13, 'y') + std::to_string(i));
+    tfile::writeLines(testFilename, lines);
+    auto size = tfile::size(testFilename);
+
+    auto all = tfile::read(testFilename);
+    REQUIRE(tfile::read(testFilename, 300, 40) == all.substr(300, 40));
+    REQUIRE(tfile::read(testFilename, size - 2, 10).size() == 2);
+
+    // Every line is read exactly once, whatever the ranges.
+    for (size_t step : {1, 7, 100, 4096}) {
+        tfile::Lines result;
+        tfile::Reader reader(testFilename);
+        for (size_t begin = 0; begin < size; begin += step)
+            reader.lines(begin, begin + step).read(result);
+        REQUIRE(result == lines);
+    }
+}
+
+TEST_CASE("ConcatReader", "[ConcatReader]") {
+    auto const testFilename3 = "/tmp/tfile.file3.txt";
+    FileDeleter d1{testFilename}, d2{testFilename2}, d3{testFilename3};
+
+    tfile::write(testFilename, "one\ntw");
+    tfile::write(testFilename2, "");
+    tfile::write(testFilename3, "o\nthree\nfour");
+
+    tfile::ConcatReader reader({testFilename, testFilename2, testFilename3});
+    REQUIRE(reader.size() == 18);
+    tfile::Lines expected{"one", "two", "three", "four"};
+    REQUIRE(reader.lines().read() == expected);
+
+    // Ranges work across files.
+    tfile::Lines result;
+    reader.lines(0, 5).read(result);
+    reader.lines(5, 12).read(result);
+    reader.lines(12, 18).read(result);
+    REQUIRE(result == expected);
+}
+
+TEST_CASE("sampleLines", "[sampleLines]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines;
+    for (int i = 0; i < 10000; ++i)
+        lines.push_back(std::string(i % 50, '.') + std::to_string(i));
+    tfile::writeLines(testFilename, lines);
+    std::set<std::string> all(lines.begin(), lines.end());
+
+    for (auto sampling : {tfile::Sampling::approximate,
+                          tfile::Sampling::exact}) {
+        auto sample = tfile::sampleLines(testFilename, 100, 1, sampling);
+        REQUIRE(sample.size() == 100);
+        std::set<std::string> unique(sample.begin(), sample.end());
+        REQUIRE(unique.size() == 100);
+        auto known = [&] (const std::string& s) { return all.count(s); };
+        REQUIRE(std::all_of(sample.begin(), sample.end(), known));
+    }
+
+    auto sample = tfile::sampleLines(testFilename, 20000, 1,
+                                     tfile::Sampling::exact);
+    REQUIRE(sample == lines);
+    REQUIRE(tfile::sampleLines(testFilename, 0, 1,
+                               tfile::Sampling::exact).empty());
+    REQUIRE(tfile::sampleLines(testFilename, 0, 1,
+                               tfile::Sampling::approximate).empty());
+
+    // Lines longer than the first backwards read, with two-byte newlines.
+    std::string data;
+    std::vector<size_t> starts;
+    for (size_t length : {0, 1, 0x1ff, 0x200, 0x201, 0x3000, 0x11000, 5}) {
+        starts.push_back(data.size());
+        data += std::string(length, 'x') + "\r\n";
+    }
+    tfile::write(testFilename, data);
+    tfile::Reader reader(testFilename);
+    auto fd = fileno(reader.get());
+    for (size_t i = 0; i < starts.size(); ++i) {
+        auto end = i + 1 < starts.size() ? starts[i + 1] : data.size();
+        for (auto offset : {starts[i], (starts[i] + end) / 2, end - 1}) {
+            REQUIRE(tfile::lineStart<tfile::Newline::windows>(fd, offset) ==
+                    starts[i]);
+        }
+    }
+}
+
+TEST_CASE("lookupSorted", "[lookupSorted]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines;
+    for (int i = 0; i < 10000; i += 2)
+        lines.push_back(std::to_string(100000 + i) + "\tvalue " + std::to_string(i));
+    tfile::writeLines(testFilename, lines);
+
+    struct Key {
+        std::string operator()(const std::string& line) const {
+            return line.substr(0, line.find('\t'));
+        }
+    };
+
+    std::string line;
+    REQUIRE(tfile::lookupSorted(testFilename, "104242", line, Key()));
+    REQUIRE(line == "104242\tvalue 4242");
+    REQUIRE(not tfile::lookupSorted(testFilename, "104243", line, Key()));
+    REQUIRE(tfile::lookupSorted(testFilename, lines[0], line));
+    REQUIRE(line == lines[0]);
+
+    auto results = tfile::lookupSorted(
+        testFilename, {"109998", "0", "100000", "105001", "107777", "9"},
+        Key());
+    REQUIRE(results.size() == 6);
+    REQUIRE(results[0].found);
+    REQUIRE(results[0].line == lines.back());
+    REQUIRE(not results[1].found);
+    REQUIRE(results[2].line == lines.front());
+    REQUIRE(not results[3].found);
+    REQUIRE(not results[4].found);
+    REQUIRE(not results[5].found);
+
+    // Lines longer than the first read when looking for a line start.
+    lines.clear();
+    for (int i = 0; i < 200; ++i) {
+        lines.push_back(std::to_string(1000 + i) + "\t" +
+                        std::string(i % 10 * 0x180, 'v'));
+    }
+    tfile::writeLines(testFilename, lines);
+    results = tfile::lookupSorted(testFilename, {"1000", "1077", "1199"},
+                                  Key());
+    REQUIRE(results[0].line == lines[0]);
+    REQUIRE(results[1].line == lines[77]);
+    REQUIRE(results[2].line == lines[199]);
+
+    std::string data;
+    std::vector<size_t> starts;
+    for (size_t length : {0, 1, 0x1fe, 0x1ff, 0x200, 0x3000, 0x11000, 5}) {
+        starts.push_back(data.size());
+        data += std::string(length, 'x') + "\r\n";
+    }
+    tfile::write(testFilename, data);
+    tfile::Reader reader(testFilename);
+    auto fd = fileno(reader.get());
+    for (size_t i = 1; i < starts.size(); ++i) {
+        auto previous = starts[i - 1];
+        for (auto offset : {previous + 1, (previous + starts[i]) / 2,
+                            starts[i] - 1, starts[i]}) {
+            if (offset > previous) {
+                REQUIRE(tfile::nextLineStart<tfile::Newline::windows>(
+                    fd, offset) == starts[i]);
+            }
+        }
+    }
+    REQUIRE(tfile::nextLineStart<tfile::Newline::windows>(
+        fd, data.size() - 1) == data.size());
+}
+
+TEST_CASE("snapshot", "[snapshot]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines{"one", "", "three\nlines\n", std::string(0x200000, 'x')};
+    for (int i = 0; i < 1000; ++i)
+        lines.push_back(std::to_string(i));
+
+    auto bytes = tfile::saveSnapshot(testFilename, lines);
+    REQUIRE(bytes == tfile::size(testFilename));
+
+    auto snapshot = tfile::loadSnapshot(testFilename);
+    REQUIRE(snapshot.size() == lines.size());
+    REQUIRE(snapshot[0] == "one");
+    REQUIRE(snapshot[1].empty());
+    REQUIRE(snapshot[2] == lines[2]);
+    REQUIRE(snapshot[3].str() == lines[3]);
+    REQUIRE(snapshot[999] < snapshot[1000]);
+    REQUIRE(std::equal(snapshot.begin(), snapshot.end(), lines.begin(),
+        [] (tfile::StringView x, const std::string& y) { return x == y; }));
+
+    tfile::saveSnapshot(testFilename, tfile::Lines());
+    snapshot = tfile::loadSnapshot(testFilename);
+    REQUIRE(snapshot.empty());
+
+    tfile::write(testFilename, "not a snapshot at all");
+    REQUIRE_THROWS(tfile::loadSnapshot(testFilename));
+}
+
+TEST_CASE("frontCoded", "[frontCoded]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines{""};
+    for (int i = 0; i < 1000; ++i) {
+        auto url = "https://example.com/path/to/page/" + std::to_string(i);
+        lines.push_back(url);
+    }
+    std::sort(lines.begin(), lines.end());
+    tfile::writeLines(testFilename, lines);
+
+    auto strings = tfile::readFrontCoded(testFilename);
+    REQUIRE(strings.size() == lines.size());
+    REQUIRE(strings[0] == "");
+    REQUIRE(strings[17] == lines[17]);
+    REQUIRE(strings[999] == lines[999]);
+    REQUIRE(std::equal(strings.begin(), strings.end(), lines.begin()));
+    REQUIRE(strings.bytes() * 3 < tfile::size(testFilename));
+
+    REQUIRE(strings.find("") == 0);
+    REQUIRE(strings.find(lines[500]) == 500);
+    REQUIRE(strings.find(lines.back()) == lines.size() - 1);
+    REQUIRE(strings.find("https://example.com/") == std::string::npos);
+    REQUIRE(strings.find("zzz") == std::string::npos);
+
+    tfile::FrontCoded unsorted(tfile::Lines{"b", "a", "ab"});
+    REQUIRE(tfile::Lines(unsorted.begin(), unsorted.end()) ==
+            (tfile::Lines{"b", "a", "ab"}));
+}
+
+TEST_CASE("interning", "[interning]") {
+    FileDeleter d1{testFilename};
+
+    tfile::Lines lines;
+    for (int i = 0; i < 1000; ++i)
+        lines.push_back(i % 3 ? "GET" : "POST");
+    lines.push_back("DELETE");
+    tfile::writeLines(testFilename, lines);
+
+    tfile::InternPool pool;
+    auto handles = tfile::readInterned(testFilename, pool);
+    REQUIRE(handles.size() == lines.size());
+    REQUIRE(pool.size() == 3);
+    REQUIRE(handles[0] == handles[3]);
+    REQUIRE(handles[0] != handles[1]);
+    REQUIRE(*handles[1] == "GET");
+    REQUIRE(handles.back() == pool.find("DELETE"));
+    REQUIRE(pool.find("PUT") == nullptr);
+    REQUIRE(pool.count("POST") == 334);
+    REQUIRE(pool.count("GET") == 666);
+    REQUIRE(pool.count("PUT") == 0);
+
+    auto again = tfile::readInterned(testFilename, pool);
+    REQUIRE(again == handles);
+    REQUIRE(pool.counts().at("DELETE") == 2);
+}
+
+TEST_CASE("executor", "[executor]") {
+    FileDeleter d1{testFilename};
+    FileDeleter d2{testFilename2};
+
+    struct Counting : tfile::Executor {
+        explicit Counting(size_t threads) : pool(threads) {}
+        void submit(Task task) override {
+            ++submitted;
+            pool.submit(std::move(task));
+        }
+        size_t concurrency() const override { return pool.concurrency(); }
+
+        tfile::ThreadPool pool;
+        std::atomic<size_t> submitted{0};
+    };
+
+    std::atomic<int> sum{0};
+    {
+        tfile::ThreadPool pool(4);
+        REQUIRE(pool.concurrency() == 4);
+        for (int i = 1; i <= 100; ++i)
+            pool.submit([&sum, i] () { sum += i; });
+    }
+    REQUIRE(sum == 5050);
+
+    tfile::Lines lines;
+    for (int i = 0; i < 200000; ++i)
+        lines.push_back(std::to_string(i * 7919 % 200000));
+    tfile::writeLines(testFilename, lines);
+
+    Counting counting(3);
+    tfile::sortLines(testFilename, testFilename2, 0x10000000,
+                     std::less<std::string>(), &counting);
+    REQUIRE(counting.submitted > 0);
+    std::sort(lines.begin(), lines.end());
+    REQUIRE(tfile::readLines(testFilename2) == lines);
+
+    // A busy single worker can't stall a search: the caller helps.
+    std::string text(0x900000, '.');
+    for (size_t i = 0; i < text.size(); i += 0x1000)
+        text[i] = '!';
+    tfile::write(testFilename, text);
+
+    Counting one(1);
+    one.submit([] () {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    });
+    REQUIRE(tfile::countMatches(testFilename, "!", 8, &one) == 0x900);
+    REQUIRE(one.submitted == 8);
+}
+
+TEST_CASE("walk", "[walk]") {
+    FileDeleter d1{testFilename};
+    std::string root = "/tmp/tfile.walk";
+    auto cleanUp = [&] () {
+        REQUIRE(system(("rm -rf " + root).c_str()) == 0);
+    };
+    cleanUp();
+
+    std::map<std::string, size_t> expected;
+    for (auto dir : {"", "/a", "/a/b", "/a/b/c", "/d"}) {
+        mkdir((root + dir).c_str(), 0777);
+        for (int i = 0; i < 20; ++i) {
+            auto name = root + dir + "/" + std::to_string(i) + ".txt";
+            tfile::writeLines(name.c_str(), tfile::Lines(i, "line"));
+            expected[name] = i;
+        }
+    }
+    REQUIRE(symlink("/tmp", (root + "/link").c_str()) == 0);
+
+    std::mutex mutex;
+    std::map<std::string, size_t> lines;
+    size_t bytes = 0;
+    auto files = tfile::walk((root + "/").c_str(), [&] (
+            const tfile::WalkEntry& entry) {
+        auto count = tfile::countLines(entry.path.c_str());
+        std::lock_guard<std::mutex> lock(mutex);
+        lines[entry.path] = count;
+        bytes += entry.size;
+    });
+    cleanUp();
+
+    REQUIRE(files == 100);
+    REQUIRE(lines == expected);
+    REQUIRE(bytes == 5 * 190 * 5);
+    REQUIRE_THROWS(tfile::walk(root.c_str(), [] (const tfile::WalkEntry&) {}));
+
+    // Many directories, each with a child, under a low descriptor limit.
+    mkdir(root.c_str(), 0777);
+    for (int i = 0; i < 400; ++i) {
+        auto dir = root + "/d" + std::to_string(i);
+        mkdir(dir.c_str(), 0777);
+        mkdir((dir + "/sub").c_str(), 0777);
+        tfile::write((dir + "/sub/f").c_str(), "f");
+    }
+    struct rlimit before, lowered;
+    REQUIRE(getrlimit(RLIMIT_NOFILE, &before) == 0);
+    lowered = before;
+    lowered.rlim_cur = 128;
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &lowered) == 0);
+    std::atomic<size_t> visited{0};
+    files = tfile::walk(root.c_str(), [&] (const tfile::WalkEntry&) {
+        ++visited;
+    });
+    REQUIRE(setrlimit(RLIMIT_NOFILE, &before) == 0);
+    cleanUp();
+    REQUIRE(files == 400);
+    REQUIRE(visited == 400);
+
+    // The files of one large directory are visited by several threads.
+    mkdir(root.c_str(), 0777);
+    for (int i = 0; i < 1000; ++i)
+        tfile::write((root + "/" + std::to_string(i)).c_str(), "");
+    tfile::ThreadPool pool(4);
+    std::set<std::thread::id> threads;
+    std::set<std::string> names;
+    files = tfile::walk(root.c_str(), [&] (const tfile::WalkEntry& entry) {
+        std::this_thread::sleep_for(std::chrono::microseconds(200));
+        std::lock_guard<std::mutex> lock(mutex);
+        threads.insert(std::this_thread::get_id());
+        names.insert(entry.name);
+    }, &pool);
+    cleanUp();
+    REQUIRE(files == 1000);
+    REQUIRE(names.size() == 1000);
+    REQUIRE(threads.size() > 1);
+
+    // A visitor's exception stops the walk and is rethrown by walk().
+    mkdir(root.c_str(), 0777);
+    for (int i = 0; i < 1000; ++i)
+        tfile::write((root + "/" + std::to_string(i)).c_str(), "");
+    std::atomic<size_t> calls{0};
+    REQUIRE_THROWS_AS(tfile::walk(root.c_str(), [&] (const tfile::WalkEntry&) {
+        if (++calls == 10)
+            throw std::logic_error("stop");
+    }, &pool), std::logic_error);
+    cleanUp();
+    REQUIRE(calls < 1000);
+
+    tfile::write(testFilename, "one\ntwo\nthree");
+    REQUIRE(tfile::countLines(testFilename) == 3);
+    tfile::write(testFilename, "");
+    REQUIRE(tfile::countLines(testFilename) == 0);
+}
+
+TEST_CASE("directory", "[directory]") {
+    FileDeleter d1{testFilename};
+    FileDeleter d2{testFilename2};
+
+    tfile::Directory tmp("/tmp");
+    auto name = testFilename + strlen("/tmp/");
+    auto name2 = testFilename2 + strlen("/tmp/");
+
+    REQUIRE(tmp.write(name, "hello\nworld\n") == 12);
+    REQUIRE(tfile::read(testFilename) == "hello\nworld\n");
+    REQUIRE(tmp.read(name) == "hello\nworld\n");
+    REQUIRE(tmp.readLines(name) == (tfile::Lines{"hello", "world"}));
+    REQUIRE(tmp.size(name) == 12);
+    REQUIRE(tmp.size("tfile.no.such.file") == static_cast<size_t>(-1));
+
+    {
+        tfile::Appender appender(tmp, name);
+        appender.write("again\n");
+    }
+    REQUIRE(tfile::readLines(testFilename).back() == "again");
+
+    {
+        tfile::Writer writer(tmp, name2);
+        writer.write("written");
+    }
+    REQUIRE(tfile::read(testFilename2) == "written");
+
+    tfile::Directory root("/");
+    tfile::Directory sub(root, "tmp");
+    REQUIRE(sub.read(name2) == "written");
+
+    REQUIRE_THROWS(tfile::Reader(tmp, "tfile.no.such.file"));
+    REQUIRE_THROWS(tfile::Directory("/tmp/tfile.no.such.directory"));
+
+    REQUIRE(tfile::modeString(tfile::Mode::readAppend) ==
+            std::string(tfile::modeString<tfile::Mode::readAppend>()));
+    REQUIRE(tfile::modeString(tfile::Mode::truncate) == std::string("w+"));
+}